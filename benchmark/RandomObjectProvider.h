@@ -16,7 +16,8 @@ class RandomObjectProvider {
         static constexpr int ZIPF_DISTRIBUTION = 5;
         static constexpr size_t MAX_SIZE = 10 * 1024;
 
-        char tempObjectContent[MAX_SIZE] = {};
+        // Thread-local so that values can be generated by parallel construction
+        static inline thread_local char tempObjectContent[MAX_SIZE] = {};
         int distribution;
         size_t averageLength;
         size_t N;
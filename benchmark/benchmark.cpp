@@ -6,6 +6,7 @@
 #include <SeparatorObjectStore.h>
 #include <ParallelCuckooObjectStore.h>
 #include <BumpingHashObjectStore.h>
+#include <DensestConstruction.h>
 #include <cstdint>
 #include <bytehamster/util/XorShift64.h>
 #include <tlx/cmdline_parser.hpp>
@@ -31,6 +32,10 @@ bool readOnly = false;
 size_t keyGenerationSeed = SEED_RANDOM;
 size_t iterations = 1;
 size_t numThreads = 1;
+size_t constructionThreads = 1;
+size_t densestAttempts = 0;
+bool queryIntoDestination = false;
+size_t writeQueueDepth = pachash::WritePipeline::DEFAULT_DEPTH;
 std::mutex queryOutputMutex;
 std::unique_ptr<Barrier> queryOutputBarrier = nullptr;
 RandomObjectProvider randomObjectProvider;
@@ -44,6 +49,10 @@ struct BenchmarkSettings {
            << " numObjects=" << numObjects
            << " loadFactor=" << loadFactor
            << " threads=" << numThreads
+           << " constructionThreads=" << constructionThreads
+           << " densestAttempts=" << densestAttempts
+           << " queryIntoDestination=" << queryIntoDestination
+           << " writeQueueDepth=" << writeQueueDepth
            << " objectSize=" << averageObjectSize
            << " objectSizeDistribution=" << lengthDistribution;
         return os;
@@ -100,18 +109,34 @@ void prepareQueryPlan(std::vector<pachash::StoreConfig::key_t> &keyQueryOrder,
 
 template<typename ObjectStore, typename IoManager>
 void performQueries(ObjectStore &objectStore, const std::vector<pachash::StoreConfig::key_t> &keys) {
+    pachash::QueryBufferPool bufferPool;
     std::vector<pachash::QueryHandle> queryHandles;
     queryHandles.reserve(queueDepth);
     for (size_t i = 0; i < queueDepth; i++) {
-        queryHandles.emplace_back(objectStore);
+        queryHandles.emplace_back(bufferPool);
     }
     pachash::ObjectStoreView<ObjectStore, IoManager> objectStoreView(objectStore, useCachedIo ? 0 : O_DIRECT, queueDepth);
+    // Each handle reads into its own slot of memory owned by the caller instead of a pooled buffer
+    size_t destinationSize = (objectStore.requiredBufferPerQuery() + pachash::StoreConfig::BLOCK_LENGTH - 1)
+            / pachash::StoreConfig::BLOCK_LENGTH * pachash::StoreConfig::BLOCK_LENGTH;
+    char *destinations = nullptr;
+    if (queryIntoDestination) {
+        destinations = new (std::align_val_t(pachash::StoreConfig::BLOCK_LENGTH)) char[queueDepth * destinationSize];
+    }
+    auto enqueueQuery = [&](pachash::QueryHandle *queryHandle) {
+        if (queryIntoDestination) {
+            size_t slot = queryHandle - queryHandles.data();
+            objectStoreView.enqueueQuery(queryHandle, destinations + slot * destinationSize, destinationSize);
+        } else {
+            objectStoreView.enqueueQuery(queryHandle);
+        }
+    };
     std::vector<pachash::StoreConfig::key_t> keyQueryOrder;
     prepareQueryPlan(keyQueryOrder, keys);
     // Fill in-flight queue
     for (size_t i = 0; i < queueDepth; i++) {
         queryHandles[i].key = keyQueryOrder[i];
-        objectStoreView.enqueueQuery(&queryHandles[i]);
+        enqueueQuery(&queryHandles[i]);
     }
     objectStoreView.submit();
     size_t queriesDone = 0;
@@ -123,7 +148,7 @@ void performQueries(ObjectStore &objectStore, const std::vector<pachash::StoreCo
         while (queryHandle != nullptr) {
             validateValue(queryHandle);
             queryHandle->key = keyQueryOrder[queriesDone];
-            objectStoreView.enqueueQuery(queryHandle);
+            enqueueQuery(queryHandle);
             queriesDone++;
             queryHandle = objectStoreView.peekAny();
         }
@@ -137,6 +162,9 @@ void performQueries(ObjectStore &objectStore, const std::vector<pachash::StoreCo
         pachash::QueryHandle *queryHandle = objectStoreView.awaitAny();
         validateValue(queryHandle);
     }
+    if (destinations != nullptr) {
+        operator delete[](destinations, std::align_val_t(pachash::StoreConfig::BLOCK_LENGTH));
+    }
 
     long timeMicroseconds = std::chrono::duration_cast<std::chrono::microseconds>(queryEnd - queryStart).count();
     std::cout<<"\rExecuted "<<numQueries<<" queries in "<<timeMicroseconds/1000<<" ms, "
@@ -166,25 +194,52 @@ void performQueries(ObjectStore &objectStore, const std::vector<pachash::StoreCo
 template<typename ObjectStore, typename IoManager>
 void runTest() {
     std::vector<pachash::StoreConfig::key_t> keys = generateRandomKeys(numObjects);
+    auto HashFunction = [](const pachash::StoreConfig::key_t &key) -> pachash::StoreConfig::key_t {
+        return key;
+    };
+    auto LengthEx = [](const pachash::StoreConfig::key_t &key) -> size_t {
+        return randomObjectProvider.getLength(key);
+    };
+    auto ValueEx = [](const pachash::StoreConfig::key_t &key) -> const char * {
+        return randomObjectProvider.getValue(key);
+    };
 
-    ObjectStore objectStore(loadFactor, storeFile.c_str(), useCachedIo ? 0 : O_DIRECT);
+    std::unique_ptr<ObjectStore> objectStorePtr;
+    if (densestAttempts > 0 && !readOnly) {
+        if constexpr (requires { objectStorePtr->placeObjects(keys.begin(), keys.end(), HashFunction, LengthEx); }) {
+            std::vector<float> loadFactors;
+            for (size_t i = 0; i < densestAttempts && loadFactor - 0.01 * i > 0; i++) {
+                loadFactors.push_back(loadFactor - 0.01 * i);
+            }
+            std::cout << "# " << ObjectStore::name() << " in " << storeFile << " with N=" << numObjects
+                      << ", densest of alpha=" << loadFactors.back() << ".." << loadFactor << std::endl;
+            objectStorePtr = pachash::writeToFileDensest<ObjectStore>(loadFactors, storeFile.c_str(),
+                    useCachedIo ? 0 : O_DIRECT, keys.begin(), keys.end(), HashFunction, LengthEx, ValueEx,
+                    constructionThreads);
+            pachash::LOG("Syncing written file");
+            sync();
+        } else {
+            throw std::invalid_argument("Construction of " + ObjectStore::name()
+                    + " cannot fail, so it does not support densest_attempts");
+        }
+    } else {
+        objectStorePtr = std::make_unique<ObjectStore>(loadFactor, storeFile.c_str(), useCachedIo ? 0 : O_DIRECT);
+        objectStorePtr->writeQueueDepth = writeQueueDepth;
+        std::cout << "# " << ObjectStore::name() << " in " << storeFile << " with N=" << numObjects << ", alpha=" << loadFactor << std::endl;
+    }
+    ObjectStore &objectStore = *objectStorePtr;
 
-    std::cout << "# " << ObjectStore::name() << " in " << storeFile << " with N=" << numObjects << ", alpha=" << loadFactor << std::endl;
-    if (!readOnly) {
-        auto HashFunction = [](const pachash::StoreConfig::key_t &key) -> pachash::StoreConfig::key_t {
-            return key;
-        };
-        auto LengthEx = [](const pachash::StoreConfig::key_t &key) -> size_t {
-            return randomObjectProvider.getLength(key);
-        };
-        auto ValueEx = [](const pachash::StoreConfig::key_t &key) -> const char * {
-            return randomObjectProvider.getValue(key);
-        };
-        objectStore.writeToFile(keys.begin(), keys.end(), HashFunction, LengthEx, ValueEx);
+    if (!readOnly && densestAttempts == 0) {
+        if constexpr (requires { objectStore.writeToFile(keys.begin(), keys.end(),
+                                    HashFunction, LengthEx, ValueEx, constructionThreads); }) {
+            objectStore.writeToFile(keys.begin(), keys.end(), HashFunction, LengthEx, ValueEx, constructionThreads);
+        } else {
+            objectStore.writeToFile(keys.begin(), keys.end(), HashFunction, LengthEx, ValueEx);
+        }
         pachash::LOG("Syncing written file");
         sync();
     }
-    objectStore.buildIndex();
+    objectStore.buildIndex(constructionThreads);
 
     if (numQueries == 0) {
         objectStore.printConstructionStats();
@@ -275,8 +330,13 @@ int main(int argc, char** argv) {
               "Undefined behavior if the file is not valid or was created with another method. Only makes sense in combination with --key_seed.");
     cmd.add_size_t('x', "key_seed", keyGenerationSeed, "Seed for the key generation. When not specified, uses a random seed for each run.");
     cmd.add_size_t('t', "num_threads", numThreads, "Number of threads to execute the benchmark in.");
+    cmd.add_size_t("construction_threads", constructionThreads, "Number of threads to use for construction and for loading the index, if supported by the method.");
+    cmd.add_size_t("densest_attempts", densestAttempts, "Try up to this many load factors, starting with the given one and decreasing in steps of 0.01. "
+              "Keeps the densest successful construction, see writeToFileDensest(). Attempts run in the construction threads. Only for the separator and cuckoo methods.");
+    cmd.add_size_t("write_queue_depth", writeQueueDepth, "Number of write buffers during construction. All but one can be in flight at the same time.");
 
     cmd.add_bytes('q', "num_queries", numQueries, "Number of keys to query, supports SI units (eg. 10M)");
+    cmd.add_bool("query_destination", queryIntoDestination, "Read query results into memory owned by the benchmark instead of the buffers of the query handles");
     cmd.add_size_t('p', "queue_depth", queueDepth, "Number of queries to keep in flight");
     cmd.add_size_t('i', "iterations", iterations, "Perform the same benchmark multiple times.");
 
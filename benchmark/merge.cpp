@@ -5,7 +5,8 @@
 #include <Merge.h>
 #include <tlx/cmdline_parser.hpp>
 
-void benchmarkMerge(std::vector<std::string> &inputFiles, std::string &outputFile) {
+void benchmarkMerge(std::vector<std::string> &inputFiles, std::string &outputFile, size_t numThreads,
+                    pachash::MergeMode mode, bool copyBlocks) {
     auto time1 = std::chrono::high_resolution_clock::now();
     std::cout << "# Merging input files: ";
     for (const std::string& inputFile : inputFiles) {
@@ -13,7 +14,13 @@ void benchmarkMerge(std::vector<std::string> &inputFiles, std::string &outputFil
     }
     std::cout<<std::endl;
 
-    pachash::merge(inputFiles, outputFile);
+    size_t copiedBlocks = 0;
+    if (copyBlocks) {
+        copiedBlocks = pachash::mergeCopyingBlocks(inputFiles, outputFile, O_DIRECT, 0,
+                                                   pachash::MERGE_DEFAULT_READ_BUFFER, mode);
+    } else {
+        pachash::merge(inputFiles, outputFile, O_DIRECT, 0, pachash::MERGE_DEFAULT_READ_BUFFER, numThreads, mode);
+    }
 
     auto time2 = std::chrono::high_resolution_clock::now();
     pachash::LOG("Flushing");
@@ -27,6 +34,8 @@ void benchmarkMerge(std::vector<std::string> &inputFiles, std::string &outputFil
               << util::prettyBytes(1000.0 * space / time) << "/s)" << std::endl;
     std::cout << "RESULT"
               << " files=" << inputFiles.size()
+              << " threads=" << numThreads
+              << " copiedBlocks=" << copiedBlocks
               << " merge=" << std::chrono::duration_cast<std::chrono::nanoseconds>(time2 - time1).count()
               << " sync=" << std::chrono::duration_cast<std::chrono::nanoseconds>(time3 - time2).count()
               << std::endl;
@@ -36,11 +45,19 @@ int main(int argc, char** argv) {
     std::vector<std::string> inputFiles;
     std::string outputFile;
     size_t iterations = 1;
+    bool sweep = false;
+    size_t numThreads = 1;
+    bool newestWins = false;
+    bool copyBlocks = false;
 
     tlx::CmdlineParser cmd;
     cmd.add_stringlist('i', "input_file", inputFiles, "Input file that should be merged. Can be specified multiple times");
     cmd.add_string('o', "output_file", outputFile, "File to write the merged data structure to");
     cmd.add_size_t('n', "iterations", iterations, "Merge multiple times");
+    cmd.add_size_t('t', "threads", numThreads, "Number of key ranges to merge in parallel");
+    cmd.add_bool('u', "newest_wins", newestWins, "Input files are ordered from oldest to newest. Keep the newest object of each key and apply tombstones");
+    cmd.add_bool('c', "copy_blocks", copyBlocks, "Copy blocks that only one input contributes to instead of repacking their objects. Single-threaded");
+    cmd.add_bool('s', "sweep", sweep, "Merge the first 2, 4, 8, ... input files to measure the influence of the number of inputs");
 
     if (!cmd.process(argc, argv)) {
         return 1;
@@ -52,8 +69,16 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    pachash::MergeMode mode = newestWins ? pachash::MergeMode::NEWEST_WINS : pachash::MergeMode::DISJOINT;
     for (size_t i = 0; i < iterations; i++) {
-        benchmarkMerge(inputFiles, outputFile);
+        if (!sweep) {
+            benchmarkMerge(inputFiles, outputFile, numThreads, mode, copyBlocks);
+            continue;
+        }
+        for (size_t k = 2; k < 2 * inputFiles.size(); k *= 2) {
+            std::vector<std::string> prefix(inputFiles.begin(), inputFiles.begin() + std::min(k, inputFiles.size()));
+            benchmarkMerge(prefix, outputFile, numThreads, mode, copyBlocks);
+        }
     }
     return 0;
 }
\ No newline at end of file
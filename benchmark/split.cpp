@@ -0,0 +1,56 @@
+#include <chrono>
+#include <thread>
+#include <IoManager.h>
+#include <PaCHashObjectStore.h>
+#include <Merge.h>
+#include <tlx/cmdline_parser.hpp>
+
+int main(int argc, char** argv) {
+    std::string inputFile;
+    std::string outputPrefix;
+    size_t numOutputs = 2;
+    size_t numThreads = 1;
+    size_t indexBinsPerBlock = 0;
+
+    tlx::CmdlineParser cmd;
+    cmd.add_string('i', "input_file", inputFile, "File that should be split");
+    cmd.add_string('o', "output_prefix", outputPrefix, "Output files are named <prefix>0, <prefix>1, ...");
+    cmd.add_size_t('n', "num_outputs", numOutputs, "Number of output files, each gets an equal share of the key space");
+    cmd.add_size_t('t', "threads", numThreads, "Number of output files to write in parallel");
+    cmd.add_size_t('a', "index_footer", indexBinsPerBlock, "Append an index footer for the PaCHash parameter a to each output");
+
+    if (!cmd.process(argc, argv)) {
+        return 1;
+    }
+
+    if (inputFile.empty() || outputPrefix.empty() || numOutputs == 0) {
+        std::cerr<<"Need input file, output prefix and number of outputs"<<std::endl;
+        cmd.print_usage();
+        return 1;
+    }
+
+    std::vector<std::string> outputFiles;
+    for (size_t i = 0; i < numOutputs; i++) {
+        outputFiles.push_back(outputPrefix + std::to_string(i));
+    }
+    auto time1 = std::chrono::high_resolution_clock::now();
+    pachash::split(inputFile, outputFiles, O_DIRECT, indexBinsPerBlock, pachash::MERGE_DEFAULT_READ_BUFFER,
+                   numThreads);
+    auto time2 = std::chrono::high_resolution_clock::now();
+    pachash::LOG("Flushing");
+    sync();
+    pachash::LOG(nullptr);
+    auto time3 = std::chrono::high_resolution_clock::now();
+
+    size_t space = util::filesize(inputFile);
+    size_t time = std::chrono::duration_cast<std::chrono::milliseconds >(time3 - time1).count();
+    std::cout << "Splitting " << util::prettyBytes(space) << " completed in " << time << " ms ("
+              << util::prettyBytes(1000.0 * space / time) << "/s)" << std::endl;
+    std::cout << "RESULT"
+              << " outputs=" << numOutputs
+              << " threads=" << numThreads
+              << " split=" << std::chrono::duration_cast<std::chrono::nanoseconds>(time2 - time1).count()
+              << " sync=" << std::chrono::duration_cast<std::chrono::nanoseconds>(time3 - time2).count()
+              << std::endl;
+    return 0;
+}
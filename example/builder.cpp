@@ -0,0 +1,39 @@
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <PaCHashBuilder.h>
+#include <PaCHashObjectStore.h>
+
+/**
+ * Writes objects that are already sorted by key without keeping them in memory.
+ * The values are generated on-the-fly by a value producer that appends them in multiple pieces.
+ * The resulting file is opened with a regular PaCHashObjectStore.
+ */
+int main() {
+    std::vector<pachash::StoreConfig::key_t> keys;
+    for (size_t i = 0; i < 1000; i++) {
+        std::string key = "Key" + std::to_string(i);
+        keys.push_back(bytehamster::util::MurmurHash64(key.data(), key.length()));
+    }
+    std::sort(keys.begin(), keys.end());
+
+    pachash::PaCHashBuilder builder("key_value_store.db", 0, 8);
+    for (pachash::StoreConfig::key_t key : keys) {
+        std::string suffix = std::to_string(key % 1000);
+        builder.append(key, 6 + suffix.length(), [&](pachash::ValueSink &sink) {
+            sink.append("Value-", 6);
+            sink.append(suffix.data(), suffix.length());
+        });
+    }
+    builder.finish();
+
+    pachash::PaCHashObjectStore<8> objectStore(1.0, "key_value_store.db", 0);
+    objectStore.buildIndex();
+    pachash::ObjectStoreView<pachash::PaCHashObjectStore<8>, pachash::PosixIO> objectStoreView(objectStore, 0, 1);
+    pachash::QueryHandle queryHandle(objectStore);
+    queryHandle.prepare("Key2");
+    objectStoreView.submitQuery(&queryHandle);
+    objectStoreView.awaitAny();
+    std::cout<<"Retrieved: "<<std::string(queryHandle.resultPtr, queryHandle.length)<<std::endl;
+    return 0;
+}
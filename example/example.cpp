@@ -4,9 +4,8 @@
 
 /**
  * Most basic example. Constructs an object store and queries a key.
- * Note that passing an array of pairs is not efficient
- * because the hash function is executed way too often during construction.
- * Rather, you should add an object that caches the hash somewhere.
+ * When passing an array of pairs, each key is hashed only once and only small
+ * (hash, index) records are sorted. See PaCHashObjectStore::writeToFileHashOnce.
  */
 int main() {
     std::vector<std::pair<std::string, std::string>> keysAndValues;
@@ -0,0 +1,31 @@
+#include <string>
+#include <iostream>
+#include <ExternalPaCHashBuilder.h>
+#include <PaCHashObjectStore.h>
+
+/**
+ * Constructs an object store that is larger than the given memory budget.
+ * The objects are written in sorted runs to temporary files, which are then merged into the output file.
+ * The resulting file is opened with a regular PaCHashObjectStore.
+ */
+int main() {
+    size_t memoryBudget = 16 * 1024 * 1024;
+    pachash::ExternalPaCHashBuilder builder("key_value_store.db", 0, memoryBudget, "", 8);
+    for (size_t i = 0; i < 100000; i++) {
+        builder.add("Key" + std::to_string(i), "Value" + std::to_string(i) + std::string(400, '.'));
+    }
+    builder.finish();
+    std::cout<<"Wrote "<<builder.numObjects<<" objects with "
+             <<bytehamster::util::prettyBytes(builder.totalPayloadSize)<<" of payload"<<std::endl;
+
+    pachash::PaCHashObjectStore<8> objectStore(1.0, "key_value_store.db", 0);
+    objectStore.buildIndex();
+    pachash::ObjectStoreView<pachash::PaCHashObjectStore<8>, pachash::PosixIO> objectStoreView(objectStore, 0, 1);
+    pachash::QueryHandle queryHandle(objectStore);
+    queryHandle.prepare("Key42");
+    objectStoreView.submitQuery(&queryHandle);
+    objectStoreView.awaitAny();
+    std::string value(queryHandle.resultPtr, queryHandle.length);
+    std::cout<<"Retrieved: "<<value.substr(0, value.find('.'))<<" ("<<value.length()<<" bytes)"<<std::endl;
+    return 0;
+}
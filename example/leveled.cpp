@@ -0,0 +1,41 @@
+#include <string>
+#include <iostream>
+#include <LeveledObjectStore.h>
+
+/**
+ * Modifies objects after construction. Changes are collected in memory and written as small PaCHash files
+ * that are merged in the background. The small memory table makes the example flush and compact multiple times.
+ * Running the example again reopens the store from its manifest.
+ */
+int main() {
+    auto hash = [](const std::string &key) {
+        return bytehamster::util::MurmurHash64(key.data(), key.length());
+    };
+    size_t numKeys = 10000;
+    {
+        pachash::LeveledObjectStore<8> store("leveled_store", 0, 64 * 1024, 4);
+        for (size_t i = 0; i < numKeys; i++) {
+            store.put(hash("Key" + std::to_string(i)), "Value" + std::to_string(i));
+        }
+        for (size_t i = 0; i < numKeys; i += 2) {
+            store.put(hash("Key" + std::to_string(i)), "Updated" + std::to_string(i));
+        }
+        store.remove(hash("Key1"));
+
+        // Make sure that errors are reported here instead of in the destructor
+        store.flush();
+        store.awaitCompaction();
+        std::cout<<"Write amplification: "<<store.writeAmplification()<<std::endl;
+    }
+
+    pachash::LeveledObjectStore<8> store("leveled_store");
+    std::string value;
+    for (std::string key : {"Key0", "Key1", "Key3"}) {
+        if (store.get(hash(key), value)) {
+            std::cout<<"Retrieved "<<key<<": "<<value<<std::endl;
+        } else {
+            std::cout<<"Not found: "<<key<<std::endl;
+        }
+    }
+    return 0;
+}
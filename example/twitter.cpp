@@ -9,8 +9,9 @@
  * <tweet id> <tweet content>\n
  *
  * Data is first all copied into a std::vector and then passed to the object store.
- * Note that using the default key extractor like this is rather slow
+ * Note that for the cuckoo and separator methods, using the default key extractor like this is rather slow
  * because we need to re-calculate the hash of each pair multiple times.
+ * PaCHash hashes each pair only once.
  */
 int main(int argc, char** argv) {
     std::string inputFile = "twitter-stream-2021-08-01.txt";
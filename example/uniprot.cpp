@@ -19,12 +19,14 @@ struct GeneEntry {
  * data with line breaks after 100 characters
  *
  * We assume here that the data is too much to load into an std::vector at once. So we need to re-construct
- * the values (eg. remove line breaks) dynamically while the data is written. We do that by providing a more complex
- * value extractor function that uses some temporary memory to write the data to. This is possible because the object
- * stores do not call the key extractor with other keys before the previous one is fully consumed.
+ * the values (eg. remove line breaks) dynamically while the data is written. We do that by providing a value producer
+ * instead of a value pointer extractor. It appends the lines of the sequence to a sink, which copies them
+ * directly to the output blocks. No temporary memory is needed for the re-constructed values.
  *
  * The performance depends on random disk read times because the key extractor
  * works on a memory-mapped file and is not called linearly.
+ * For PaCHash, we additionally pass a prefetch extractor, so that the
+ * reads of upcoming values can overlap with writing.
  */
 int main(int argc, char** argv) {
     std::string inputFile = "uniref50.fasta";
@@ -87,24 +89,29 @@ int main(int argc, char** argv) {
     auto lengthEx = [](const GeneEntry &x) -> size_t {
         return x.length;
     };
-    char *reconstructionBuffer = new char[50000];
-    auto valueEx = [reconstructionBuffer](const GeneEntry &x) -> const char * {
+    auto valueEx = [](const GeneEntry &x, pachash::ValueSink &sink) {
         char *pos = x.beginOfValue;
         size_t length = 0;
         while (length < x.length) {
-            if (*pos != '\n') {
-                reconstructionBuffer[length] = *pos;
-                length++;
+            char *lineEnd = pos;
+            while (*lineEnd != '\n' && length + (lineEnd - pos) < x.length) {
+                lineEnd++;
             }
-            pos++;
+            sink.append(pos, lineEnd - pos);
+            length += lineEnd - pos;
+            pos = lineEnd + 1;
         }
-        return reconstructionBuffer;
+    };
+
+    auto prefetchEx = [](const GeneEntry &x) -> std::span<const char> {
+        // Line breaks after 100 characters
+        return {x.beginOfValue, x.length + x.length / 100 + 1};
     };
 
     pachash::VariableSizeObjectStore *objectStore;
     if (type == "pachash") {
         auto pachashStore = new pachash::PaCHashObjectStore<8>(1.0, outputFile.c_str(), cachedIo ? 0 : O_DIRECT);
-        pachashStore->writeToFile(genes.begin(), genes.end(), hashFunction, lengthEx, valueEx);
+        pachashStore->writeToFile(genes.begin(), genes.end(), hashFunction, lengthEx, valueEx, prefetchEx);
         objectStore = pachashStore;
     } else if (type == "cuckoo") {
         auto cuckooStore = new pachash::ParallelCuckooObjectStore(0.95, outputFile.c_str(), cachedIo ? 0 : O_DIRECT);
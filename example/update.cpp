@@ -0,0 +1,38 @@
+#include <string>
+#include <iostream>
+#include <PaCHashObjectStore.h>
+
+/**
+ * Replaces values of an existing object store without rebuilding it.
+ * Leaving some bytes empty at the end of each block during construction allows objects to grow.
+ * Updates that do not fit return false and need a rebuild, for example with merge().
+ */
+int main() {
+    std::vector<std::pair<std::string, std::string>> keysAndValues;
+    for (size_t i = 0; i < 1000; i++) {
+        keysAndValues.emplace_back("Key" + std::to_string(i), "Value" + std::to_string(i));
+    }
+
+    pachash::PaCHashObjectStore<8> objectStore(1.0, "key_value_store.db", 0);
+    objectStore.blockSlack = 64;
+    objectStore.writeToFile(keysAndValues);
+    objectStore.buildIndex();
+
+    auto hash = [](const std::string &key) {
+        return bytehamster::util::MurmurHash64(key.data(), key.length());
+    };
+    std::string newValue = "A longer value than before";
+    bool updated = objectStore.updateInPlace(hash("Key2"), newValue.data(), newValue.length());
+    std::cout<<"Updated in place: "<<(updated ? "yes" : "no")<<std::endl;
+    std::string largeValue(pachash::StoreConfig::BLOCK_LENGTH, 'x');
+    updated = objectStore.updateInPlace(hash("Key3"), largeValue.data(), largeValue.length());
+    std::cout<<"Updated large value in place: "<<(updated ? "yes" : "no")<<std::endl;
+
+    pachash::ObjectStoreView<pachash::PaCHashObjectStore<8>, pachash::PosixIO> objectStoreView(objectStore, 0, 1);
+    pachash::QueryHandle queryHandle(objectStore);
+    queryHandle.prepare("Key2");
+    objectStoreView.submitQuery(&queryHandle);
+    objectStoreView.awaitAny();
+    std::cout<<"Retrieved: "<<std::string(queryHandle.resultPtr, queryHandle.length)<<std::endl;
+    return 0;
+}
@@ -1,5 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <vector>
+#include "IoManager.h"
+
 namespace pachash {
 
 /**
@@ -47,11 +53,16 @@ class MemoryMapBlockIterator {
 class PosixBlockIterator {
     private:
         int fd;
-        size_t currentBlockNumber = -1;
+        size_t currentBlockNumber;
+        size_t firstBlock;
         char *buffer;
         size_t batchSize;
     public:
-        PosixBlockIterator(const char *filename, size_t batchSize, int flags) : batchSize(batchSize) {
+        /**
+         * Iterates the blocks starting at firstBlock.
+         */
+        PosixBlockIterator(const char *filename, size_t batchSize, int flags, size_t firstBlock = 0)
+                : currentBlockNumber(firstBlock - 1), firstBlock(firstBlock), batchSize(batchSize) {
             fd = open(filename, O_RDONLY | flags);
             if (fd < 0) {
                 throw std::ios_base::failure("Unable to open " + std::string(filename)
@@ -71,12 +82,12 @@ class PosixBlockIterator {
         }
 
         [[nodiscard]] char *blockContent() const {
-            return buffer + (currentBlockNumber % batchSize) * StoreConfig::BLOCK_LENGTH;
+            return buffer + ((currentBlockNumber - firstBlock) % batchSize) * StoreConfig::BLOCK_LENGTH;
         }
 
         void next() {
             currentBlockNumber++;
-            if (currentBlockNumber % batchSize == 0) {
+            if ((currentBlockNumber - firstBlock) % batchSize == 0) {
                 uint read = pread(fd, buffer, batchSize * StoreConfig::BLOCK_LENGTH,
                                   currentBlockNumber * StoreConfig::BLOCK_LENGTH);
                 if (read < StoreConfig::BLOCK_LENGTH) {
@@ -183,23 +194,30 @@ class UringAnyBlockIterator {
 class UringDoubleBufferBlockIterator {
     private:
         UringIO manager;
-        size_t currentBlock = 0;
+        size_t currentBlock;
+        size_t firstBlock;
         char *currentContent1 = nullptr;
         char *currentContent2 = nullptr;
         size_t maxBlocks;
         size_t batchSize;
     public:
-        UringDoubleBufferBlockIterator(const char *filename, size_t maxBlocks, size_t batchSize, int flags)
-                : manager(filename, flags, 1), maxBlocks(maxBlocks), batchSize(batchSize) {
+        /**
+         * Iterates the blocks in range [firstBlock, maxBlocks).
+         */
+        UringDoubleBufferBlockIterator(const char *filename, size_t maxBlocks, size_t batchSize, int flags,
+                                       size_t firstBlock = 0)
+                : manager(filename, flags, 1), currentBlock(firstBlock), firstBlock(firstBlock),
+                  maxBlocks(maxBlocks), batchSize(batchSize) {
+            assert(firstBlock < maxBlocks);
             currentContent1 = new (std::align_val_t(StoreConfig::BLOCK_LENGTH)) char[batchSize * StoreConfig::BLOCK_LENGTH];
             currentContent2 = new (std::align_val_t(StoreConfig::BLOCK_LENGTH)) char[batchSize * StoreConfig::BLOCK_LENGTH];
 
-            size_t toSubmit = std::min(batchSize, maxBlocks);
+            size_t toSubmit = std::min(batchSize, maxBlocks - firstBlock);
             manager.enqueueRead(currentContent1, currentBlock * StoreConfig::BLOCK_LENGTH, toSubmit * StoreConfig::BLOCK_LENGTH, 0);
             manager.submit();
             manager.awaitAny();
-            if (toSubmit == batchSize) { // Has more than 1 batch
-                toSubmit = std::min((size_t)batchSize, maxBlocks - batchSize);
+            if (maxBlocks - firstBlock > batchSize) { // Has more than 1 batch
+                toSubmit = std::min((size_t)batchSize, maxBlocks - firstBlock - batchSize);
                 manager.enqueueRead(currentContent2, (currentBlock + batchSize) * StoreConfig::BLOCK_LENGTH, toSubmit * StoreConfig::BLOCK_LENGTH, 0);
                 manager.submit();
             }
@@ -215,13 +233,13 @@ class UringDoubleBufferBlockIterator {
         }
 
         [[nodiscard]] char *blockContent() const {
-            return currentContent1 + (currentBlock % batchSize) * StoreConfig::BLOCK_LENGTH;
+            return currentContent1 + ((currentBlock - firstBlock) % batchSize) * StoreConfig::BLOCK_LENGTH;
         }
 
         void next() {
             currentBlock++;
             assert(currentBlock < maxBlocks);
-            if (currentBlock % batchSize == 0) {
+            if ((currentBlock - firstBlock) % batchSize == 0) {
                 manager.awaitAny();
                 std::swap(currentContent1, currentContent2);
                 if (currentBlock + batchSize < maxBlocks) {
@@ -235,4 +253,250 @@ class UringDoubleBufferBlockIterator {
 };
 #endif
 
+/**
+ * Iterates the blocks in range [firstBlock, endBlock) in order.
+ * Keeps up to depth - 1 batches of blocks in flight while the current batch is processed,
+ * so that reading can keep up even if processing a batch is faster than reading it.
+ */
+class ReadAheadBlockIterator {
+    private:
+        #ifdef HAS_LIBURING
+        UringIO manager;
+        #else
+        PosixIO manager;
+        #endif
+        size_t currentBlock;
+        size_t firstBlock;
+        size_t endBlock;
+        size_t batchSize;
+        size_t depth;
+        size_t numBatches;
+        std::vector<char *> buffers;
+        std::vector<bool> bufferReady;
+        size_t readsInFlight = 0;
+    public:
+        ReadAheadBlockIterator(const char *filename, size_t endBlock, size_t batchSize, size_t depth, int flags,
+                               size_t firstBlock = 0)
+                : manager(filename, flags, depth), currentBlock(firstBlock), firstBlock(firstBlock),
+                  endBlock(endBlock), batchSize(batchSize), depth(depth) {
+            assert(firstBlock < endBlock && batchSize > 0 && depth > 0);
+            numBatches = (endBlock - firstBlock + batchSize - 1) / batchSize;
+            for (size_t i = 0; i < depth; i++) {
+                buffers.push_back(new (std::align_val_t(StoreConfig::BLOCK_LENGTH))
+                        char[batchSize * StoreConfig::BLOCK_LENGTH]);
+            }
+            bufferReady.resize(depth, false);
+            for (size_t batch = 0; batch < std::min(depth, numBatches); batch++) {
+                enqueueBatch(batch);
+            }
+            manager.submit();
+            awaitBatch(0);
+        }
+
+        ~ReadAheadBlockIterator() {
+            // The buffers must not be freed while the kernel still accesses them
+            while (readsInFlight > 0) {
+                manager.awaitAny();
+                readsInFlight--;
+            }
+            for (char *buffer : buffers) {
+                operator delete[](buffer, std::align_val_t(StoreConfig::BLOCK_LENGTH));
+            }
+        }
+
+        static constexpr size_t memoryUsage(size_t batchSize, size_t depth) {
+            return batchSize * depth * StoreConfig::BLOCK_LENGTH;
+        }
+
+        [[nodiscard]] size_t blockNumber() const {
+            return currentBlock;
+        }
+
+        [[nodiscard]] char *blockContent() const {
+            size_t offset = currentBlock - firstBlock;
+            return buffers[(offset / batchSize) % depth] + (offset % batchSize) * StoreConfig::BLOCK_LENGTH;
+        }
+
+        /**
+         * Content of the block that is distance blocks behind the current one.
+         * Returns nullptr if that block is behind the end or its read was not issued yet.
+         */
+        [[nodiscard]] char *peek(size_t distance) {
+            size_t offset = currentBlock - firstBlock + distance;
+            size_t batch = offset / batchSize;
+            if (currentBlock + distance >= endBlock || batch >= (currentBlock - firstBlock) / batchSize + depth) {
+                return nullptr;
+            }
+            awaitBatch(batch);
+            return buffers[batch % depth] + (offset % batchSize) * StoreConfig::BLOCK_LENGTH;
+        }
+
+        void next() {
+            currentBlock++;
+            assert(currentBlock < endBlock);
+            size_t offset = currentBlock - firstBlock;
+            if (offset % batchSize == 0) {
+                size_t batch = offset / batchSize;
+                // The buffer of the previous batch is free now
+                if (batch - 1 + depth < numBatches) {
+                    enqueueBatch(batch - 1 + depth);
+                    manager.submit();
+                }
+                awaitBatch(batch);
+            }
+        }
+
+    private:
+        void enqueueBatch(size_t batch) {
+            size_t block = firstBlock + batch * batchSize;
+            size_t blocks = std::min(batchSize, endBlock - block);
+            bufferReady[batch % depth] = false;
+            manager.enqueueRead(buffers[batch % depth], block * StoreConfig::BLOCK_LENGTH,
+                                blocks * StoreConfig::BLOCK_LENGTH, batch + 1);
+            readsInFlight++;
+        }
+
+        void awaitBatch(size_t batch) {
+            while (!bufferReady[batch % depth]) {
+                uint64_t completedBatch = manager.awaitAny() - 1;
+                bufferReady[completedBatch % depth] = true;
+                readsInFlight--;
+            }
+        }
+};
+
+/**
+ * Reads the blocks in range [firstBlock, endBlock) in order and calls function(blockIdx, blockContent) for each.
+ */
+template <typename Function>
+void forEachBlock(const char *filename, size_t firstBlock, size_t endBlock, int flags, Function function) {
+    if (firstBlock >= endBlock) {
+        return;
+    }
+    #ifdef HAS_LIBURING
+    UringDoubleBufferBlockIterator blockIterator(filename, endBlock, 2500, flags, firstBlock);
+    #else
+    PosixBlockIterator blockIterator(filename, 2500, flags, firstBlock);
+    #endif
+    for (size_t blockIdx = firstBlock; blockIdx < endBlock; blockIdx++) {
+        function(blockIdx, blockIterator.blockContent());
+        if (blockIdx < endBlock - 1) {
+            blockIterator.next(); // Don't try to read more than the last one
+        }
+    }
+}
+
+/**
+ * Splits the blocks into numThreads contiguous ranges, so that each thread owns the blocks of one range.
+ * Range borders are multiples of alignment.
+ */
+class BlockRanges {
+    public:
+        size_t numThreads;
+        std::vector<size_t> rangeStart;
+
+        BlockRanges(size_t numBlocks, size_t numThreads, size_t alignment)
+                : numThreads(std::max(1ul, numThreads)), rangeStart(this->numThreads + 1) {
+            size_t numUnits = (numBlocks + alignment - 1) / alignment;
+            for (size_t thread = 0; thread <= this->numThreads; thread++) {
+                rangeStart[thread] = std::min(numBlocks, numUnits * thread / this->numThreads * alignment);
+            }
+        }
+
+        [[nodiscard]] size_t firstBlock(size_t thread) const {
+            return rangeStart[thread];
+        }
+
+        [[nodiscard]] size_t endBlock(size_t thread) const {
+            return rangeStart[thread + 1];
+        }
+
+        /**
+         * The thread that owns the block.
+         */
+        [[nodiscard]] size_t rangeOf(size_t block) const {
+            return std::upper_bound(rangeStart.begin(), rangeStart.end(), block) - rangeStart.begin() - 1;
+        }
+
+        /**
+         * Calls function(thread) for each thread in its own thread.
+         * If a thread throws, the first error is rethrown after all threads have finished.
+         */
+        template <typename Function>
+        void inParallel(Function function) const {
+            if (numThreads == 1) {
+                function(0);
+                return;
+            }
+            std::vector<std::exception_ptr> errors(numThreads);
+            std::vector<std::thread> threads;
+            threads.reserve(numThreads);
+            for (size_t thread = 0; thread < numThreads; thread++) {
+                threads.emplace_back([&, thread] {
+                    try {
+                        function(thread);
+                    } catch (...) {
+                        errors[thread] = std::current_exception();
+                    }
+                });
+            }
+            for (std::thread &thread : threads) {
+                thread.join();
+            }
+            for (std::exception_ptr &error : errors) {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+            }
+        }
+};
+
+/**
+ * Items that the owners of BlockRanges pass to each other between two parallel steps.
+ */
+template <typename T>
+class ThreadMailboxes {
+    private:
+        size_t numThreads;
+        // Items passed from thread i to thread j are at index i * numThreads + j
+        std::vector<std::vector<T>> boxes;
+    public:
+        explicit ThreadMailboxes(size_t numThreads) : numThreads(numThreads), boxes(numThreads * numThreads) {
+        }
+
+        /**
+         * Only accessed by the sending thread.
+         */
+        void send(size_t from, size_t to, T item) {
+            boxes[from * numThreads + to].push_back(item);
+        }
+
+        /**
+         * Moves the items sent to the thread to the end of the target, in order of the sending threads.
+         */
+        void receive(size_t thread, std::vector<T> &target) {
+            for (size_t from = 0; from < numThreads; from++) {
+                std::vector<T> &box = boxes[from * numThreads + thread];
+                target.insert(target.end(), box.begin(), box.end());
+                box.clear();
+            }
+        }
+
+        [[nodiscard]] bool empty() const {
+            return std::all_of(boxes.begin(), boxes.end(), [](const std::vector<T> &box) { return box.empty(); });
+        }
+};
+
+/**
+ * Splits the blocks into numThreads contiguous ranges and calls function(thread, firstBlock, endBlock)
+ * for each range in its own thread. Range borders are multiples of alignment.
+ */
+template <typename Function>
+void forEachBlockRangeParallel(size_t numBlocks, size_t numThreads, size_t alignment, Function function) {
+    BlockRanges ranges(numBlocks, numThreads, alignment);
+    ranges.inParallel([&](size_t thread) {
+        function(thread, ranges.firstBlock(thread), ranges.endBlock(thread));
+    });
+}
+
 } // Namespace pachash
@@ -1,23 +1,153 @@
 #pragma once
 
+#include <stdexcept>
+#include <string>
+#include "WritePipeline.h"
+#include "ValueSink.h"
+
 namespace pachash {
 class BlockObjectWriter {
     public:
+        static constexpr uint32_t NO_ITEM = ~0u;
         struct Item {
             StoreConfig::key_t key = 0;
-            size_t length = 0;
-            uint64_t hashFunctionIndex = 0;
-            uint64_t currentHash = 0;
             void *ptr = nullptr;
+            uint32_t length = 0;
+            uint32_t hashFunctionIndex = 0;
+            uint32_t currentHash = 0;
+            uint32_t next = NO_ITEM;
         };
         struct Block {
-            std::vector<Item> items;
-            size_t length = 0;
+            uint32_t firstItem = NO_ITEM;
+            uint32_t lastItem = NO_ITEM;
+            uint32_t numItems = 0;
+            uint32_t length = 0;
+        };
+
+        /**
+         * Items of all blocks in one contiguous pool, instead of a separate vector per block.
+         * The items of each block form an intrusive linked list through the pool,
+         * so moving an item to another block neither copies nor allocates.
+         */
+        class Blocks {
+            public:
+                std::vector<Item> items;
+                std::vector<Block> blocks;
+
+                void resize(size_t numBlocks) {
+                    blocks.resize(numBlocks);
+                }
+
+                /**
+                 * Items are indexed with 32 bit integers, so there can be at most NO_ITEM - 1 of them.
+                 */
+                void reserveItems(size_t numItems) {
+                    checkNumItems(numItems);
+                    items.reserve(numItems);
+                }
+
+                void resizeItems(size_t numItems) {
+                    checkNumItems(numItems);
+                    items.resize(numItems);
+                }
+
+                static void checkNumItems(size_t numItems) {
+                    if (numItems >= NO_ITEM) {
+                        throw std::invalid_argument("Too many objects for this object store: "
+                                + std::to_string(numItems) + ", at most " + std::to_string(NO_ITEM - 1));
+                    }
+                }
+
+                [[nodiscard]] size_t size() const {
+                    return blocks.size();
+                }
+
+                Block &at(size_t block) {
+                    return blocks.at(block);
+                }
+
+                [[nodiscard]] const Block &at(size_t block) const {
+                    return blocks.at(block);
+                }
+
+                /**
+                 * Add an item to the pool, without assigning it to a block.
+                 */
+                uint32_t addItem(StoreConfig::key_t key, size_t length, void *ptr) {
+                    assert(items.size() < NO_ITEM && length < NO_ITEM);
+                    items.push_back(Item{key, ptr, uint32_t(length), 0, 0, NO_ITEM});
+                    return items.size() - 1;
+                }
+
+                void append(size_t block, uint32_t item) {
+                    Block &b = blocks[block];
+                    items[item].next = NO_ITEM;
+                    if (b.lastItem == NO_ITEM) {
+                        b.firstItem = item;
+                    } else {
+                        items[b.lastItem].next = item;
+                    }
+                    b.lastItem = item;
+                    b.numItems++;
+                }
+
+                /**
+                 * Remove the item that follows previous (or the first item if previous is NO_ITEM).
+                 */
+                uint32_t removeAfter(size_t block, uint32_t previous) {
+                    Block &b = blocks[block];
+                    uint32_t removed = previous == NO_ITEM ? b.firstItem : items[previous].next;
+                    assert(removed != NO_ITEM);
+                    uint32_t next = items[removed].next;
+                    if (previous == NO_ITEM) {
+                        b.firstItem = next;
+                    } else {
+                        items[previous].next = next;
+                    }
+                    if (b.lastItem == removed) {
+                        b.lastItem = previous;
+                    }
+                    b.numItems--;
+                    items[removed].next = NO_ITEM;
+                    return removed;
+                }
+
+                /**
+                 * Replace the items of the block by the given ones, in that order.
+                 */
+                template <typename Iterator>
+                void assign(size_t block, Iterator begin, Iterator end) {
+                    Block &b = blocks[block];
+                    b.firstItem = NO_ITEM;
+                    b.lastItem = NO_ITEM;
+                    b.numItems = 0;
+                    for (Iterator it = begin; it != end; ++it) {
+                        append(block, *it);
+                    }
+                }
+
+                template <typename F>
+                void forEachItem(size_t block, F f) const {
+                    for (uint32_t i = blocks[block].firstItem; i != NO_ITEM; i = items[i].next) {
+                        f(items[i]);
+                    }
+                }
+
+                void clear() {
+                    items.clear();
+                    items.shrink_to_fit();
+                    blocks.clear();
+                    blocks.shrink_to_fit();
+                }
         };
 
+        /**
+         * Returns the time spent waiting for the device, in nanoseconds. See WritePipeline.
+         */
         template <typename ValueExtractor, typename U>
-        static void writeBlocks(const char *filename, int fileFlags, size_t maxSize,
-                                std::vector<Block> blocks, ValueExtractor valueExtractor, uint16_t type) {
+        static size_t writeBlocks(const char *filename, int fileFlags, size_t maxSize,
+                                  const Blocks &blocks, ValueExtractor valueExtractor, uint16_t type,
+                                  size_t writeQueueDepth = WritePipeline::DEFAULT_DEPTH) {
             size_t numBlocks = blocks.size();
 
             // If the file does not exist or is a partition, truncating fails, so we silently ignore the result
@@ -25,84 +155,64 @@ class BlockObjectWriter {
             int result = truncate(filename, fileSize);
             (void) result;
 
-            size_t blocksPerBatch = 250;
-            char *buffer1 = new (std::align_val_t(StoreConfig::BLOCK_LENGTH))
-                    char[blocksPerBatch * StoreConfig::BLOCK_LENGTH];
-            char *buffer2 = new (std::align_val_t(StoreConfig::BLOCK_LENGTH))
-                    char[blocksPerBatch * StoreConfig::BLOCK_LENGTH];
-            memset(buffer1, 0, blocksPerBatch * StoreConfig::BLOCK_LENGTH);
-            memset(buffer2, 0, blocksPerBatch * StoreConfig::BLOCK_LENGTH);
-
-            #ifdef HAS_LIBURING
-            UringIO ioManager(filename, fileFlags | O_RDWR | O_CREAT, 2);
-            #else
-            PosixIO ioManager(filename, fileFlags | O_RDWR | O_CREAT, 2);
-            #endif
-
-            Item firstMetadataItem = {0,sizeof(VariableSizeObjectStore::StoreMetadata), 0};
-            blocks.at(0).items.insert(blocks.at(0).items.begin(), firstMetadataItem);
+            WritePipeline pipeline(filename, fileFlags, writeQueueDepth);
+            pipeline.preallocate(0, fileSize);
 
+            size_t batchStart = 0;
             for (size_t blockIdx = 0; blockIdx <= numBlocks; blockIdx++) {
-                if (blockIdx % blocksPerBatch == 0 && blockIdx != 0) {
-                    if (blockIdx != blocksPerBatch) {
-                        ioManager.awaitAny();
-                    }
-                    std::swap(buffer1, buffer2);
-                    ioManager.enqueueWrite(buffer2, (blockIdx - blocksPerBatch) * StoreConfig::BLOCK_LENGTH,
-                                           blocksPerBatch*StoreConfig::BLOCK_LENGTH, 0);
-                    ioManager.submit();
+                if (blockIdx - batchStart == pipeline.batchBlocks) {
+                    pipeline.write(batchStart * StoreConfig::BLOCK_LENGTH, blockIdx - batchStart);
+                    batchStart = blockIdx;
                 }
+                char *blockStart = pipeline.buffer() + (blockIdx - batchStart) * StoreConfig::BLOCK_LENGTH;
+                // Buffers are re-used, so clear the block to make the output deterministic
+                memset(blockStart, 0, StoreConfig::BLOCK_LENGTH);
                 if (blockIdx == numBlocks) {
-                    VariableSizeObjectStore::BlockStorage::init(
-                            buffer1 + (blockIdx % blocksPerBatch) * StoreConfig::BLOCK_LENGTH, 0);
-                    continue;
+                    continue; // Empty block behind the last one. Written explicitly in case the file existed.
                 }
-                Block &block = blocks.at(blockIdx);
+                const Block &block = blocks.at(blockIdx);
+                size_t numItems = block.numItems + (blockIdx == 0 ? 1 : 0); // Metadata pseudo object
                 VariableSizeObjectStore::BlockStorage storage = VariableSizeObjectStore::BlockStorage::init(
-                        buffer1 + (blockIdx % blocksPerBatch) * StoreConfig::BLOCK_LENGTH, block.items.size());
+                        blockStart, numItems);
+                assert(numItems < StoreConfig::num_objects_t(~0) && "Increase StoreConfig::num_objects_t size");
 
                 size_t writeOffset = 0;
                 size_t i = 0;
-                assert(block.items.size() < StoreConfig::num_objects_t(~0) && "Increase StoreConfig::num_objects_t size");
-                for (const Item &item : block.items) {
-                     if (i > 0) { // First offset is always 0
+                auto writeItem = [&](StoreConfig::key_t key, size_t length, void *ptr) {
+                    if (i > 0) { // First offset is always 0
                         storage.offsets[i - 1] = writeOffset;
-                        if (i == block.items.size() - 1) {
-                            // Last item also stores its end offset
-                            storage.offsets[i] = writeOffset + item.length;
-                        }
                     }
-                    storage.keys[i] = item.key;
+                    if (i == numItems - 1) {
+                        // Last item also stores its end offset
+                        storage.offsets[i] = writeOffset + length;
+                    }
+                    storage.keys[i] = key;
 
-                    if (item.key == 0) {
+                    if (key == 0) {
                         VariableSizeObjectStore::StoreMetadata metadata;
                         metadata.numBlocks = numBlocks;
                         metadata.maxSize = maxSize;
                         metadata.type = type;
                         memcpy(storage.blockStart + writeOffset, &metadata, sizeof(VariableSizeObjectStore::StoreMetadata));
                     } else {
-                        const char *objectContent = valueExtractor(*((U*)item.ptr));
-                        memcpy(storage.blockStart + writeOffset, objectContent, item.length);
+                        copyValue(valueExtractor, *((U*)ptr), storage.blockStart + writeOffset, length);
                     }
-                    writeOffset += item.length;
+                    writeOffset += length;
                     i++;
+                };
+                if (blockIdx == 0) {
+                    writeItem(0, sizeof(VariableSizeObjectStore::StoreMetadata), nullptr);
                 }
+                blocks.forEachItem(blockIdx, [&](const Item &item) {
+                    writeItem(item.key, item.length, item.ptr);
+                });
                 LOG("Writing", blockIdx, numBlocks);
             }
 
-            if (numBlocks % blocksPerBatch != 0) {
-                // Write block that was started but not flushed
-                ioManager.enqueueWrite(buffer1, (numBlocks - (numBlocks % blocksPerBatch)) * StoreConfig::BLOCK_LENGTH,
-                                       (numBlocks % blocksPerBatch) * StoreConfig::BLOCK_LENGTH, 0);
-                ioManager.submit();
-                ioManager.awaitAny();
-            }
-            if (numBlocks >= blocksPerBatch) {
-                ioManager.awaitAny(); // Last block submitted in the loop
-            }
-
-            delete[] buffer1;
-            delete[] buffer2;
+            // Write blocks that were started but not flushed
+            pipeline.write(batchStart * StoreConfig::BLOCK_LENGTH, numBlocks + 1 - batchStart);
+            pipeline.awaitAll();
+            return pipeline.writeStallNanoseconds();
         }
 };
 
@@ -18,8 +18,7 @@ class BumpingHashObjectStore : public VariableSizeObjectStore {
     private:
         using Super = VariableSizeObjectStore;
         using Item = typename BlockObjectWriter::Item;
-        using Block = typename BlockObjectWriter::Block;
-        std::vector<Block> blocks;
+        BlockObjectWriter::Blocks blocks;
         pasta::BitVector *overflownBlocks = nullptr;
         pasta::FlatRankSelect<pasta::OptimizedFor::ZERO_QUERIES> *rank = nullptr;
         BumpingHashObjectStore *nextLayer = nullptr;
@@ -69,6 +68,7 @@ class BumpingHashObjectStore : public VariableSizeObjectStore {
                 numBlocks = std::max(3 * numBlocks, 500ul);
             }
             blocks.resize(this->numBlocks);
+            blocks.reserveItems(numObjects);
             constructionTimer.notifyDeterminedSpace();
 
             it = begin;
@@ -77,10 +77,9 @@ class BumpingHashObjectStore : public VariableSizeObjectStore {
                 assert(key != 0); // Key 0 holds metadata
                 size_t size = lengthExtractor(*it);
                 totalPayloadSize += size;
-                Item item{key, size, 0, 0, &*it};
                 size_t block = hash(key);
-                this->blocks.at(block).items.push_back(item);
-                this->blocks.at(block).length += item.length + overheadPerObject;
+                blocks.append(block, blocks.addItem(key, size, &*it));
+                blocks.at(block).length += size + overheadPerObject;
 
                 LOG("Inserting", i, this->numObjects);
                 it++;
@@ -94,9 +93,9 @@ class BumpingHashObjectStore : public VariableSizeObjectStore {
                 if (blocks.at(i).length > maxSize) {
                     (*overflownBlocks)[i] = true;
                     overflown++;
-                    for (const Item &item : blocks.at(i).items) {
+                    blocks.forEachItem(i, [&](const Item &item) {
                         overflownKeys.push_back(hashFunction(*((U*)item.ptr)));
-                    }
+                    });
                 } else {
                     blocks.at(writeTo) = blocks.at(i);
                     writeTo++;
@@ -117,8 +116,9 @@ class BumpingHashObjectStore : public VariableSizeObjectStore {
             }
 
             constructionTimer.notifyPlacedObjects();
-            BlockObjectWriter::writeBlocks<ValuePointerExtractor, U>(
-                    filename, openFlags, maxSize, blocks, valuePointerExtractor, 42);
+            size_t writeStall = BlockObjectWriter::writeBlocks<ValuePointerExtractor, U>(
+                    filename, openFlags, maxSize, blocks, valuePointerExtractor, 42, writeQueueDepth);
+            constructionTimer.notifyWriteStall(writeStall);
             constructionTimer.notifyWroteObjects();
         }
 
@@ -127,7 +127,7 @@ class BumpingHashObjectStore : public VariableSizeObjectStore {
             delete nextLayer;
         }
 
-        void buildIndex() final {
+        void buildIndex([[maybe_unused]] size_t numThreads = 1) final {
             constructionTimer.notifySyncedFile();
             constructionTimer.notifyReadComplete();
         }
@@ -222,7 +222,9 @@ class BumpingHashObjectStore : public VariableSizeObjectStore {
             handle->state = 0;
 
             size_t rankedBlock = rank->rank0(block);
-            for (const Item &item : blocks.at(rankedBlock).items) {
+            for (uint32_t i = blocks.at(rankedBlock).firstItem; i != BlockObjectWriter::NO_ITEM;
+                    i = blocks.items[i].next) {
+                const Item &item = blocks.items[i];
                 if (item.key == handle->key) {
                     handle->length = item.length;
                     handle->resultPtr = reinterpret_cast<char *>(42);
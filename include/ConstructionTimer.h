@@ -10,6 +10,7 @@ class ConstructionTimer {
                  << " place_objects=" << (double)q.timePlaceObjects
                  << " write_objects=" << (double)q.timeWriteObjects
                  << " sync_file=" << (double)q.timeSyncFile
+                 << " write_stall=" << (double)q.timeWriteStall
                  << " read_objects=" << (double)q.timeReadFromFile;
             return os;
         }
@@ -19,6 +20,7 @@ class ConstructionTimer {
         size_t timeWriteObjects = 0;
         size_t timeSyncFile = 0;
         size_t timeReadFromFile = 0;
+        size_t timeWriteStall = 0;
         size_t state = 0;
         std::chrono::system_clock::time_point timepoints[6];
 
@@ -48,6 +50,13 @@ class ConstructionTimer {
             assert(state == 0 || state++ == 4);
         }
 
+        /**
+         * Part of the time for writing the objects that was spent waiting for the device.
+         */
+        void notifyWriteStall(size_t nanoseconds) {
+            timeWriteStall += nanoseconds;
+        }
+
         void notifyReadComplete() {
             timepoints[5] = std::chrono::high_resolution_clock::now();
             timeDetermineSize += std::chrono::duration_cast<std::chrono::nanoseconds>(timepoints[1] - timepoints[0]).count();
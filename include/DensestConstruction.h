@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "VariableSizeObjectStore.h"
+
+namespace pachash {
+/**
+ * Writes the objects with the highest of the given load factors for which the construction succeeds.
+ * Intended for stores whose construction can fail, like SeparatorObjectStore and ParallelCuckooObjectStore.
+ * Up to numThreads attempts place the objects concurrently, starting with the highest load factors.
+ * When an attempt succeeds, all attempts with a lower or equal load factor are cancelled or skipped.
+ * Only the densest successful attempt writes the file.
+ * In descending order of the load factors, attempt i uses seed i for stores that have a seed,
+ * so a load factor can be listed multiple times to try it with different seeds.
+ * Each running attempt keeps its own placement in memory, and the extractor functions are called
+ * concurrently. Throws if no attempt succeeds. Errors other than failed attempts, like I/O errors or bad_alloc,
+ * cancel all attempts and are rethrown. Call buildIndex() on the returned store as usual.
+ */
+template <typename ObjectStore, class Iterator, typename HashFunction, typename LengthExtractor,
+        typename ValuePointerExtractor, class U = typename std::iterator_traits<Iterator>::value_type>
+std::unique_ptr<ObjectStore> writeToFileDensest(std::vector<float> loadFactors, const char *filename, int openFlags,
+                                                Iterator begin, Iterator end, HashFunction hashFunction,
+                                                LengthExtractor lengthExtractor,
+                                                ValuePointerExtractor valuePointerExtractor, size_t numThreads) {
+    std::stable_sort(loadFactors.begin(), loadFactors.end(), std::greater<>());
+    size_t numAttempts = loadFactors.size();
+    std::vector<std::atomic<bool>> cancelled(numAttempts);
+    std::atomic<size_t> nextAttempt = 0;
+    std::mutex winnerMutex;
+    size_t winner = numAttempts;
+    std::unique_ptr<ObjectStore> winnerStore;
+    std::exception_ptr error;
+
+    auto runAttempts = [&] {
+        for (size_t attempt = nextAttempt++; attempt < numAttempts; attempt = nextAttempt++) {
+            if (cancelled[attempt]) {
+                continue;
+            }
+            std::unique_ptr<ObjectStore> store;
+            try {
+                store = std::make_unique<ObjectStore>(loadFactors[attempt], filename, openFlags);
+                store->cancelConstruction = &cancelled[attempt];
+                if constexpr (requires { store->seed; }) {
+                    store->seed = attempt;
+                }
+                store->placeObjects(begin, end, hashFunction, lengthExtractor);
+            } catch (const std::invalid_argument &) {
+                continue; // Failed or cancelled
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(winnerMutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                for (std::atomic<bool> &cancel : cancelled) {
+                    cancel = true;
+                }
+                return;
+            }
+            std::lock_guard<std::mutex> lock(winnerMutex);
+            if (attempt < winner) {
+                winner = attempt;
+                winnerStore = std::move(store);
+                for (size_t i = attempt + 1; i < numAttempts; i++) {
+                    cancelled[i] = true;
+                }
+            }
+        }
+    };
+    numThreads = std::max(1ul, std::min(numThreads, numAttempts));
+    std::vector<std::thread> threads;
+    threads.reserve(numThreads);
+    for (size_t thread = 0; thread < numThreads; thread++) {
+        threads.emplace_back(runAttempts);
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if (winnerStore == nullptr) {
+        throw std::invalid_argument("Unable to construct with any of the given load factors");
+    }
+    LOG("Writing");
+    winnerStore->template writePlacedObjects<ValuePointerExtractor, U>(valuePointerExtractor);
+    return winnerStore;
+}
+} // Namespace pachash
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <ips2ra.hpp>
+#include <bytehamster/util/MurmurHash64.h>
+#include "VariableSizeObjectStore.h"
+#include "LinearObjectWriter.h"
+#include "BlockIterator.h"
+#include "LinearObjectReader.h"
+#include "Merge.h"
+
+namespace pachash {
+/**
+ * Constructs a PaCHash file from an unsorted stream of objects with bounded memory.
+ * Objects are collected in a buffer. When it is full, the buffer is sorted by key and
+ * written as a temporary PaCHash file (run). Finally, the runs are merged into the output file.
+ * If there are more runs than can be merged within the memory budget, the merge uses multiple passes.
+ * The resulting file can be opened with PaCHashObjectStore.
+ */
+class ExternalPaCHashBuilder {
+    private:
+        struct Record {
+            StoreConfig::key_t key;
+            size_t offset;
+            size_t length;
+        };
+        std::string filename;
+        std::string tempPrefix;
+        int openFlags;
+        size_t memoryBudget;
+        size_t indexBinsPerBlock;
+        char *buffer = nullptr;
+        size_t bufferSize = 0;
+        size_t bufferUsed = 0;
+        size_t recordsInBuffer = 0;
+        std::vector<std::string> runs;
+        size_t runsCreated = 0;
+        size_t maxSize = 0;
+        bool finished = false;
+    public:
+        size_t numObjects = 0;
+        size_t totalPayloadSize = 0;
+
+        /**
+         * @param memoryBudget Bytes of memory that the builder allocates for buffering and merging.
+         * @param tempPrefix Prefix of the temporary files. Defaults to the output filename.
+         * @param indexBinsPerBlock Parameter a of the PaCHashObjectStore that will open the file.
+         *          Stores an IndexFooter for it, so that it does not need to scan the file. 0 to disable.
+         */
+        ExternalPaCHashBuilder(const char *filename, int openFlags, size_t memoryBudget, std::string tempPrefix = "",
+                               size_t indexBinsPerBlock = 0)
+                : filename(filename), tempPrefix(tempPrefix.empty() ? std::string(filename) : tempPrefix),
+                  openFlags(openFlags), memoryBudget(memoryBudget), indexBinsPerBlock(indexBinsPerBlock) {
+            if (memoryBudget < LinearObjectWriter::MEMORY_USAGE + 2 * LinearObjectReader<true>::memoryUsage(0)) {
+                throw std::invalid_argument("Memory budget too small, need at least "
+                        + std::to_string(LinearObjectWriter::MEMORY_USAGE
+                                + 2 * LinearObjectReader<true>::memoryUsage(0)) + " bytes");
+            }
+            // The writer of a run is allocated while the buffer is in use
+            bufferSize = (memoryBudget - LinearObjectWriter::MEMORY_USAGE) / sizeof(Record) * sizeof(Record);
+            buffer = new (std::align_val_t(alignof(Record))) char[bufferSize];
+        }
+
+        ~ExternalPaCHashBuilder() {
+            operator delete[](buffer, std::align_val_t(alignof(Record)));
+            for (const std::string &run : runs) {
+                std::remove(run.c_str());
+            }
+        }
+
+        /**
+         * Add an object with the given (hashed) key. The content is copied. Key 0 is reserved for metadata.
+         */
+        void add(StoreConfig::key_t key, size_t length, const char *content) {
+            if (finished) {
+                throw std::logic_error("Adding to a finished ExternalPaCHashBuilder");
+            }
+            if (key == 0) {
+                throw std::invalid_argument("Key 0 is reserved for metadata");
+            }
+            if (!fitsIntoBuffer(length)) {
+                if (recordsInBuffer == 0) {
+                    throw std::invalid_argument("Object of size " + std::to_string(length)
+                            + " does not fit into the memory budget");
+                }
+                writeRun();
+                if (!fitsIntoBuffer(length)) {
+                    throw std::invalid_argument("Object of size " + std::to_string(length)
+                            + " does not fit into the memory budget");
+                }
+            }
+            memcpy(buffer + bufferUsed, content, length);
+            recordsInBuffer++;
+            records()[0] = Record{key, bufferUsed, length};
+            bufferUsed += length;
+            maxSize = std::max(maxSize, length);
+            totalPayloadSize += length;
+            numObjects++;
+        }
+
+        void add(const std::string &key, const std::string &value) {
+            add(bytehamster::util::MurmurHash64(key.data(), key.length()), value.length(), value.data());
+        }
+
+        /**
+         * Write the output file. If everything fits into the buffer, no temporary files are written.
+         */
+        void finish() {
+            if (finished) {
+                throw std::logic_error("ExternalPaCHashBuilder already finished");
+            }
+            finished = true;
+            if (runs.empty()) {
+                writeBuffer(filename, indexBinsPerBlock);
+                return;
+            }
+            if (recordsInBuffer > 0) {
+                writeRun();
+            }
+            // The buffer is not needed anymore. Use the whole budget for merging.
+            operator delete[](buffer, std::align_val_t(alignof(Record)));
+            buffer = nullptr;
+
+            size_t reconstructionMemory = std::max(maxSize, sizeof(VariableSizeObjectStore::StoreMetadata));
+            size_t readerMemory = LinearObjectReader<true>::memoryUsage(reconstructionMemory);
+            size_t fanIn = std::max(2ul, (memoryBudget - LinearObjectWriter::MEMORY_USAGE) / readerMemory);
+            // Remaining budget is shared as read-ahead buffer, so merges of few runs read ahead further
+            size_t fixedMemory = LinearObjectWriter::MEMORY_USAGE + std::min(fanIn, runs.size()) * reconstructionMemory;
+            size_t readBufferBytes = memoryBudget > fixedMemory ? memoryBudget - fixedMemory : 0;
+            while (runs.size() > fanIn) {
+                std::vector<std::string> inputs(runs.begin(), runs.begin() + fanIn);
+                std::string output = nextRunFilename();
+                merge(inputs, output, openFlags, 0, readBufferBytes);
+                for (const std::string &input : inputs) {
+                    std::remove(input.c_str());
+                }
+                runs.erase(runs.begin(), runs.begin() + fanIn);
+                runs.push_back(output);
+            }
+            merge(runs, filename, openFlags, indexBinsPerBlock, readBufferBytes);
+            for (const std::string &run : runs) {
+                std::remove(run.c_str());
+            }
+            runs.clear();
+        }
+
+    private:
+        /**
+         * Objects are written to the front of the buffer, records grow from the back.
+         */
+        Record *records() {
+            return reinterpret_cast<Record *>(buffer + bufferSize) - recordsInBuffer;
+        }
+
+        [[nodiscard]] bool fitsIntoBuffer(size_t length) const {
+            return bufferUsed + length + (recordsInBuffer + 1) * sizeof(Record) <= bufferSize;
+        }
+
+        std::string nextRunFilename() {
+            return tempPrefix + ".run" + std::to_string(runsCreated++);
+        }
+
+        void writeRun() {
+            std::string runFilename = nextRunFilename();
+            runs.push_back(runFilename);
+            writeBuffer(runFilename, 0);
+        }
+
+        void writeBuffer(const std::string &outputFile, size_t binsPerBlock) {
+            LOG("Sorting run");
+            Record *begin = records();
+            Record *end = begin + recordsInBuffer;
+            ips2ra::sort(begin, end, [](const Record &record) { return record.key; });
+            LOG("Writing run");
+            LinearObjectWriter writer(outputFile.c_str(), openFlags);
+            if (binsPerBlock > 0) {
+                writer.enableIndexFooter(binsPerBlock);
+            }
+            for (Record *record = begin; record != end; record++) {
+                if (record != begin && record->key == (record - 1)->key) {
+                    throw std::invalid_argument("Key " + std::to_string(record->key) + " was added multiple times");
+                }
+                writer.write(record->key, record->length, buffer + record->offset);
+                LOG("Writing run", record - begin, recordsInBuffer);
+            }
+            writer.close(VariableSizeObjectStore::StoreMetadata::TYPE_PACHASH);
+            bufferUsed = 0;
+            recordsInBuffer = 0;
+        }
+};
+} // Namespace pachash
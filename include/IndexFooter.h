@@ -0,0 +1,197 @@
+#pragma once
+
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <bytehamster/util/Function.h>
+#include "StoreConfig.h"
+
+namespace pachash {
+/**
+ * Persistent copy of the PaCHash index that is stored behind the last block of the file.
+ * Stores the first bin intersecting with each block as an Elias-Fano coded sequence.
+ * These are the values that the index data structures are built from,
+ * so loading the footer replaces the scan over all blocks.
+ * Layout: number of table entries, lower bits of all bins, unary coded upper bits.
+ */
+class IndexFooter {
+    public:
+        /**
+         * Collects the keys that determine the first bin of each block while the file is written.
+         * The number of bins depends on the final number of blocks, so the bins are calculated at the end.
+         */
+        class Recorder {
+            private:
+                std::vector<StoreConfig::key_t> lastKeyBeforeBlock;
+                std::vector<std::pair<size_t, StoreConfig::key_t>> firstKeyOfBlock;
+                StoreConfig::key_t lastKey = 0;
+                size_t numTableEntries = 0;
+            public:
+                Recorder() {
+                    lastKeyBeforeBlock.push_back(0);
+                }
+
+                void objectStarted(size_t block, StoreConfig::key_t key, bool atBlockStart) {
+                    if (key == 0) {
+                        return; // Metadata or terminator
+                    }
+                    if (atBlockStart) {
+                        firstKeyOfBlock.emplace_back(block, key);
+                    }
+                    lastKey = key;
+                }
+
+                void blockCompleted(size_t tableEntries) {
+                    lastKeyBeforeBlock.push_back(lastKey);
+                    numTableEntries += tableEntries;
+                }
+
+                /**
+                 * Continue with the blocks recorded by the writer of the block range that directly follows.
+                 */
+                void append(const Recorder &next) {
+                    for (size_t i = 1; i < next.lastKeyBeforeBlock.size(); i++) {
+                        // 0 means that the writer of the next range did not see a key yet
+                        StoreConfig::key_t key = next.lastKeyBeforeBlock[i];
+                        lastKeyBeforeBlock.push_back(key == 0 ? lastKey : key);
+                    }
+                    firstKeyOfBlock.insert(firstKeyOfBlock.end(), next.firstKeyOfBlock.begin(), next.firstKeyOfBlock.end());
+                    if (next.lastKey != 0) {
+                        lastKey = next.lastKey;
+                    }
+                    numTableEntries += next.numTableEntries;
+                }
+
+                /**
+                 * Calls pushBin for the first bin of every block, in order.
+                 */
+                template <typename PushBin>
+                void forEachBin(size_t numBlocks, size_t binsPerBlock, PushBin pushBin) const {
+                    assert(lastKeyBeforeBlock.size() >= numBlocks);
+                    size_t numBins = numBlocks * binsPerBlock;
+                    auto firstKeyIt = firstKeyOfBlock.begin();
+                    for (size_t block = 0; block < numBlocks; block++) {
+                        size_t bin = key2bin(lastKeyBeforeBlock[block], numBins);
+                        if (firstKeyIt != firstKeyOfBlock.end() && firstKeyIt->first == block) {
+                            // Same rule as the scan in PaCHashObjectStore::buildIndex
+                            size_t firstBinInThisBlock = key2bin(firstKeyIt->second, numBins);
+                            if (firstBinInThisBlock > bin) {
+                                bin = firstBinInThisBlock - 1;
+                            }
+                            firstKeyIt++;
+                        }
+                        pushBin(bin);
+                    }
+                }
+
+                [[nodiscard]] std::vector<uint64_t> encode(size_t numBlocks, size_t binsPerBlock) const {
+                    size_t lowerBits = bytehamster::util::ceillog2(binsPerBlock);
+                    size_t lowerWords = (numBlocks * lowerBits + 63) / 64;
+                    std::vector<uint64_t> data(1 + lowerWords + (2 * numBlocks + 63) / 64, 0);
+                    data[0] = numTableEntries;
+                    uint64_t *lower = data.data() + 1;
+                    uint64_t *upper = lower + lowerWords;
+                    size_t block = 0;
+                    forEachBin(numBlocks, binsPerBlock, [&](size_t bin) {
+                        if (lowerBits > 0) {
+                            uint64_t lowerValue = bin & ((1ul << lowerBits) - 1);
+                            size_t bitPosition = block * lowerBits;
+                            lower[bitPosition / 64] |= lowerValue << (bitPosition % 64);
+                            if (bitPosition % 64 + lowerBits > 64) {
+                                lower[bitPosition / 64 + 1] |= lowerValue >> (64 - bitPosition % 64);
+                            }
+                        }
+                        size_t upperPosition = (bin >> lowerBits) + block;
+                        upper[upperPosition / 64] |= 1ul << (upperPosition % 64);
+                        block++;
+                    });
+                    return data;
+                }
+        };
+
+        static size_t key2bin(StoreConfig::key_t key, size_t numBins) {
+            #ifdef __SIZEOF_INT128__ // fastrange64
+                static_assert(sizeof(key) == sizeof(uint64_t));
+                return (uint64_t)(((__uint128_t)key * (__uint128_t)numBins) >> 64);
+            #else
+                return key / (~size_t(0)/numBins);
+            #endif
+        }
+
+        /**
+         * Calls pushBin for the first bin of every block, in order.
+         * Returns the number of table entries in the file.
+         */
+        template <typename PushBin>
+        static size_t decode(const std::vector<uint64_t> &data, size_t numBlocks, size_t binsPerBlock,
+                             PushBin pushBin) {
+            size_t lowerBits = bytehamster::util::ceillog2(binsPerBlock);
+            size_t lowerWords = (numBlocks * lowerBits + 63) / 64;
+            size_t upperWords = (2 * numBlocks + 63) / 64;
+            if (data.size() != 1 + lowerWords + upperWords) {
+                throw std::logic_error("Index footer has unexpected size");
+            }
+            const uint64_t *lower = data.data() + 1;
+            const uint64_t *upper = lower + lowerWords;
+            size_t upperWord = 0;
+            uint64_t remainingBits = upperWords > 0 ? upper[0] : 0;
+            for (size_t block = 0; block < numBlocks; block++) {
+                while (remainingBits == 0) {
+                    upperWord++;
+                    if (upperWord >= upperWords) {
+                        throw std::logic_error("Index footer is corrupted");
+                    }
+                    remainingBits = upper[upperWord];
+                }
+                size_t upperPosition = upperWord * 64 + __builtin_ctzll(remainingBits);
+                remainingBits &= remainingBits - 1;
+                size_t bin = (upperPosition - block) << lowerBits;
+                if (lowerBits > 0) {
+                    size_t bitPosition = block * lowerBits;
+                    uint64_t lowerValue = lower[bitPosition / 64] >> (bitPosition % 64);
+                    if (bitPosition % 64 + lowerBits > 64) {
+                        lowerValue |= lower[bitPosition / 64 + 1] << (64 - bitPosition % 64);
+                    }
+                    bin |= lowerValue & ((1ul << lowerBits) - 1);
+                }
+                pushBin(bin);
+            }
+            return data[0];
+        }
+
+        /**
+         * Write the footer at the given offset. The offset must be aligned to the block length,
+         * so that it also works for files opened with O_DIRECT.
+         * Returns the size of the footer in bytes.
+         */
+        static size_t write(int fd, size_t offset, const std::vector<uint64_t> &data) {
+            size_t size = data.size() * sizeof(uint64_t);
+            size_t paddedSize = (size + StoreConfig::BLOCK_LENGTH - 1) / StoreConfig::BLOCK_LENGTH
+                    * StoreConfig::BLOCK_LENGTH;
+            char *buffer = new (std::align_val_t(StoreConfig::BLOCK_LENGTH)) char[paddedSize];
+            memset(buffer + size, 0, paddedSize - size);
+            memcpy(buffer, data.data(), size);
+            ssize_t written = pwrite(fd, buffer, paddedSize, offset);
+            operator delete[](buffer, std::align_val_t(StoreConfig::BLOCK_LENGTH));
+            if (written != ssize_t(paddedSize)) {
+                throw std::ios_base::failure("Unable to write index footer: " + std::string(strerror(errno)));
+            }
+            return size;
+        }
+
+        static std::vector<uint64_t> read(const char *filename, size_t offset, size_t size) {
+            int fd = open(filename, O_RDONLY);
+            if (fd < 0) {
+                throw std::ios_base::failure("Unable to open " + std::string(filename)
+                         + ": " + std::string(strerror(errno)));
+            }
+            std::vector<uint64_t> data(size / sizeof(uint64_t));
+            ssize_t result = pread(fd, data.data(), size, offset);
+            close(fd);
+            if (result != ssize_t(size)) {
+                throw std::ios_base::failure("Unable to read index footer of " + std::string(filename));
+            }
+            return data;
+        }
+};
+} // Namespace pachash
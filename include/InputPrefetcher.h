@@ -0,0 +1,73 @@
+#pragma once
+
+#include <span>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace pachash {
+/**
+ * Prefetch extractor that does nothing.
+ */
+struct NoPrefetch {
+    template <typename U>
+    std::span<const char> operator()(const U &) const {
+        return {};
+    }
+};
+
+/**
+ * After sorting, the input objects are accessed in hash order, which is random with respect to their
+ * location in memory. If the input is a memory-mapped file, each access can cause a blocking page fault.
+ * This looks ahead over the sorted objects and asks the kernel to read their memory asynchronously,
+ * so that the page faults overlap with writing the previous objects.
+ * The prefetch extractor returns the memory range that the value extractor will touch for an object.
+ */
+template <class Iterator, typename PrefetchExtractor>
+class InputPrefetcher {
+    private:
+        static constexpr size_t DISTANCE = 256; // Objects to look ahead
+        Iterator begin;
+        size_t endObject;
+        size_t nextToPrefetch;
+        PrefetchExtractor prefetchExtractor;
+        uintptr_t pageSize;
+        uintptr_t lastRangeStart = 0;
+        uintptr_t lastRangeEnd = 0;
+    public:
+        InputPrefetcher(Iterator begin, size_t firstObject, size_t endObject, PrefetchExtractor prefetchExtractor)
+                : begin(begin), endObject(endObject), nextToPrefetch(firstObject),
+                  prefetchExtractor(prefetchExtractor), pageSize(sysconf(_SC_PAGESIZE)) {
+        }
+
+        /**
+         * Call before accessing object i.
+         */
+        inline void beforeAccess(size_t i) {
+            if constexpr (std::is_same_v<PrefetchExtractor, NoPrefetch>) {
+                (void) i;
+                return;
+            } else {
+                while (nextToPrefetch < endObject && nextToPrefetch <= i + DISTANCE) {
+                    prefetch(prefetchExtractor(begin[nextToPrefetch]));
+                    nextToPrefetch++;
+                }
+            }
+        }
+
+    private:
+        void prefetch(std::span<const char> range) {
+            if (range.empty()) {
+                return;
+            }
+            uintptr_t start = reinterpret_cast<uintptr_t>(range.data()) & ~(pageSize - 1);
+            uintptr_t end = (reinterpret_cast<uintptr_t>(range.data()) + range.size() + pageSize - 1) & ~(pageSize - 1);
+            if (start >= lastRangeStart && end <= lastRangeEnd) {
+                return; // Small neighboring objects, avoid the system call
+            }
+            // Only a hint. Fails for memory that is not mapped, which we can safely ignore.
+            (void) madvise(reinterpret_cast<void *>(start), end - start, MADV_WILLNEED);
+            lastRangeStart = start;
+            lastRangeEnd = end;
+        }
+};
+} // Namespace pachash
@@ -71,6 +71,10 @@ class IoManager {
             close(fd);
         }
 
+        [[nodiscard]] int fileDescriptor() const {
+            return fd;
+        }
+
         virtual std::string name() = 0;
         virtual void enqueueRead(char *dest, size_t offset, size_t length, uint64_t name) = 0;
         virtual void enqueueWrite(char *src, size_t offset, size_t length, uint64_t name) = 0;
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include "StoreConfig.h"
+
+namespace pachash {
+/**
+ * Index of the key in the key table of a block, or numKeys if the block does not contain it.
+ * If the compiler targets AVX-512 or AVX2 (for example with -march=native), whole vectors of keys are compared
+ * at once. The AVX-512 kernel uses masked loads, so it never reads behind the table.
+ */
+inline size_t findKeyInTable(const StoreConfig::key_t *keys, size_t numKeys, StoreConfig::key_t key) {
+    size_t i = 0;
+    #if defined(__AVX512F__)
+        __m512i needle = _mm512_set1_epi64(int64_t(key));
+        for (; i < numKeys; i += 8) {
+            __mmask8 valid = numKeys - i >= 8 ? __mmask8(0xff) : __mmask8((1u << (numKeys - i)) - 1);
+            __mmask8 match = _mm512_mask_cmpeq_epi64_mask(valid, _mm512_maskz_loadu_epi64(valid, keys + i), needle);
+            if (match != 0) {
+                return i + __builtin_ctz(match);
+            }
+        }
+        return numKeys;
+    #else
+        #if defined(__AVX2__)
+            __m256i needle = _mm256_set1_epi64x(int64_t(key));
+            for (; i + 4 <= numKeys; i += 4) {
+                __m256i equal = _mm256_cmpeq_epi64(
+                        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)), needle);
+                int match = _mm256_movemask_pd(_mm256_castsi256_pd(equal));
+                if (match != 0) {
+                    return i + __builtin_ctz(match);
+                }
+            }
+        #endif
+        for (; i < numKeys; i++) {
+            if (keys[i] == key) {
+                return i;
+            }
+        }
+        return numKeys;
+    #endif
+}
+
+/**
+ * Like findKeyInTable, but for key tables that are sorted, like the ones of PaCHash files.
+ * The table may end with a terminator entry with key 0, which is ignored.
+ * Without vector instructions, this is a branchless binary search.
+ * With them, comparing all keys needs fewer instructions than the dependent loads of a binary search.
+ */
+inline size_t findKeyInSortedTable(const StoreConfig::key_t *keys, size_t numKeys, StoreConfig::key_t key) {
+    #if defined(__AVX512F__) || defined(__AVX2__)
+        return findKeyInTable(keys, numKeys, key);
+    #else
+        size_t searchKeys = numKeys;
+        if (searchKeys > 0 && keys[searchKeys - 1] == 0) {
+            searchKeys--;
+        }
+        if (searchKeys == 0) {
+            return numKeys;
+        }
+        // Last key that is smaller than or equal to the searched key
+        const StoreConfig::key_t *base = keys;
+        while (searchKeys > 1) {
+            size_t half = searchKeys / 2;
+            base += (base[half] <= key) ? half : 0;
+            searchKeys -= half;
+        }
+        return *base == key ? size_t(base - keys) : numKeys;
+    #endif
+}
+} // Namespace pachash
@@ -0,0 +1,494 @@
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "PaCHashObjectStore.h"
+#include "ObjectStoreView.h"
+#include "Merge.h"
+
+namespace pachash {
+/**
+ * Blocked Bloom filter over keys. The keys are already hash values, so they are not hashed again.
+ * All bits of a key are located in the same 64 bit word, so a query only accesses a single cache line.
+ * Keys can be inserted concurrently, for example by the threads of a parallel merge.
+ */
+class KeyFilter {
+    private:
+        static constexpr size_t BITS_PER_KEY = 16;
+        static constexpr size_t BITS_SET_PER_KEY = 8;
+        std::vector<std::atomic<uint64_t>> words;
+    public:
+        size_t numKeys; // Number of keys that the filter is sized for
+
+        explicit KeyFilter(size_t numKeys) : words(std::max(1ul, numKeys * BITS_PER_KEY / 64)), numKeys(numKeys) {
+        }
+
+        void insert(StoreConfig::key_t key) {
+            words[IndexFooter::key2bin(key, words.size())].fetch_or(mask(key), std::memory_order_relaxed);
+        }
+
+        [[nodiscard]] bool mayContain(StoreConfig::key_t key) const {
+            uint64_t keyMask = mask(key);
+            uint64_t word = words[IndexFooter::key2bin(key, words.size())].load(std::memory_order_relaxed);
+            return (word & keyMask) == keyMask;
+        }
+
+        /**
+         * Stores the number of keys, followed by the words.
+         */
+        void write(const std::string &filename) const {
+            std::vector<uint64_t> content;
+            content.reserve(words.size() + 1);
+            content.push_back(numKeys);
+            for (const std::atomic<uint64_t> &word : words) {
+                content.push_back(word.load(std::memory_order_relaxed));
+            }
+            std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char *>(content.data()), content.size() * sizeof(uint64_t));
+            if (!out) {
+                throw std::ios_base::failure("Unable to write " + filename);
+            }
+        }
+
+        /**
+         * Returns nullptr if the file does not exist or does not contain a complete filter.
+         */
+        static std::unique_ptr<KeyFilter> read(const std::string &filename) {
+            std::ifstream in(filename, std::ios::binary);
+            uint64_t numKeys;
+            if (!in.read(reinterpret_cast<char *>(&numKeys), sizeof(uint64_t))) {
+                return nullptr;
+            }
+            std::unique_ptr<KeyFilter> filter = std::make_unique<KeyFilter>(numKeys);
+            std::vector<uint64_t> content(filter->words.size());
+            if (!in.read(reinterpret_cast<char *>(content.data()), content.size() * sizeof(uint64_t))
+                    || in.peek() != std::ifstream::traits_type::eof()) {
+                return nullptr;
+            }
+            for (size_t i = 0; i < content.size(); i++) {
+                filter->words[i].store(content[i], std::memory_order_relaxed);
+            }
+            return filter;
+        }
+
+    private:
+        static uint64_t mask(StoreConfig::key_t key) {
+            // The word is selected by the upper bits of the key, the bits within the word by the remixed key
+            uint64_t remixed = key * 0x9E3779B97F4A7C15ul;
+            uint64_t result = 0;
+            for (size_t i = 0; i < BITS_SET_PER_KEY; i++) {
+                result |= 1ul << ((remixed >> (6 * i)) & 63);
+            }
+            return result;
+        }
+};
+
+/**
+ * Object store that absorbs new, updated and deleted objects without rebuilding everything.
+ * Changes are collected in an in-memory table. When it is full, it is written as a new PaCHash file (a run).
+ * Runs are organized in levels, each holding at most one run. Level i holds up to
+ * memtableBytes * levelRatio^(i+1) bytes. A new run is merged into level 0 by a background compaction.
+ * If a level gets too large, it is merged into the next level, and so on. Compaction uses merge()
+ * with MergeMode::NEWEST_WINS, so newer objects replace older ones and deletions are stored as tombstones
+ * until they reach the last level. Each object is rewritten about levelRatio times per level.
+ * Queries look at the in-memory table first, then at the runs from newest to oldest.
+ * Each run has an in-memory KeyFilter, so that a query usually only reads a block of the run that contains the key.
+ * The filters are built while writing the runs, so compaction only reads the inputs of each merge once.
+ * The runs are listed in a manifest file, so that the store can be reopened after calling flush().
+ * Objects are modified and queried by a single thread, while compaction runs concurrently.
+ * The destructor flushes the in-memory table. Call flush() and awaitCompaction() before to handle errors.
+ */
+template <uint16_t a>
+class LeveledObjectStore {
+    public:
+        static constexpr size_t DEFAULT_MEMTABLE_BYTES = 64 * 1024 * 1024;
+        static constexpr size_t DEFAULT_LEVEL_RATIO = 10;
+    private:
+        /**
+         * Immutable PaCHash file. The file is deleted when it was replaced by compaction and is no longer queried.
+         * Its KeyFilter is stored in a second file next to it.
+         */
+        struct Run {
+            std::string filename;
+            PaCHashObjectStore<a> store;
+            std::unique_ptr<KeyFilter> filter;
+            size_t fileSize;
+            std::atomic<bool> obsolete = false;
+            std::unique_ptr<ObjectStoreView<PaCHashObjectStore<a>, PosixIO>> view;
+            std::unique_ptr<QueryHandle> handle;
+
+            /**
+             * Opens a run that was just written, with the filter of the keys that were written to it.
+             */
+            Run(std::string filename, int openFlags, std::unique_ptr<KeyFilter> writtenFilter)
+                    : filename(std::move(filename)), store(1.0, this->filename.c_str(), openFlags),
+                      filter(std::move(writtenFilter)), fileSize(std::filesystem::file_size(this->filename)) {
+                filter->write(filterFilename(this->filename));
+                open(openFlags);
+            }
+
+            /**
+             * Opens a run that is listed in the manifest. Scans the keys of the run if its filter is missing.
+             */
+            Run(std::string filename, int openFlags)
+                    : filename(std::move(filename)), store(1.0, this->filename.c_str(), openFlags),
+                      filter(KeyFilter::read(filterFilename(this->filename))),
+                      fileSize(std::filesystem::file_size(this->filename)) {
+                if (filter == nullptr) {
+                    std::vector<StoreConfig::key_t> keys;
+                    LinearObjectReader<false> reader(this->filename.c_str(), openFlags);
+                    while (!reader.hasEnded()) {
+                        keys.push_back(reader.currentKey);
+                        reader.next();
+                    }
+                    filter = std::make_unique<KeyFilter>(keys.size());
+                    for (StoreConfig::key_t key : keys) {
+                        filter->insert(key);
+                    }
+                    filter->write(filterFilename(this->filename));
+                }
+                open(openFlags);
+            }
+
+            ~Run() {
+                view = nullptr;
+                if (obsolete) {
+                    removeFiles(filename);
+                }
+            }
+
+            static std::string filterFilename(const std::string &runFilename) {
+                return runFilename + ".filter";
+            }
+
+            static void removeFiles(const std::string &runFilename) {
+                std::remove(runFilename.c_str());
+                std::remove(filterFilename(runFilename).c_str());
+            }
+
+            void open(int openFlags) {
+                store.buildIndex();
+                view = std::make_unique<ObjectStoreView<PaCHashObjectStore<a>, PosixIO>>(store, openFlags, 1);
+                handle = std::make_unique<QueryHandle>(store);
+            }
+
+            /**
+             * Returns nullptr if the run does not contain the key.
+             * The result is valid until the next query.
+             */
+            QueryHandle *query(StoreConfig::key_t key) {
+                if (!filter->mayContain(key)) {
+                    return nullptr;
+                }
+                handle->key = key;
+                view->submitQuery(handle.get());
+                view->awaitAny();
+                return handle->resultPtr == nullptr ? nullptr : handle.get();
+            }
+        };
+
+        std::string filenamePrefix;
+        int openFlags;
+        size_t memtableBytes;
+        size_t levelRatio;
+        size_t numThreads;
+        std::map<StoreConfig::key_t, std::string> memtable;
+        size_t memtableSize = 0;
+        std::mutex runsMutex;
+        std::shared_ptr<Run> pending; // Flushed, but not merged into the levels yet
+        std::vector<std::shared_ptr<Run>> levels;
+        std::thread compactionThread;
+        std::exception_ptr compactionError;
+        std::atomic<size_t> nextRunId = 0;
+        size_t bytesInserted = 0;
+        std::atomic<size_t> bytesWritten = 0;
+    public:
+        /**
+         * Opens the store with the given file name prefix, or creates it if its manifest does not exist.
+         * Compaction merges with numThreads threads, see merge().
+         */
+        explicit LeveledObjectStore(std::string filenamePrefix, int openFlags = 0,
+                                    size_t memtableBytes = DEFAULT_MEMTABLE_BYTES,
+                                    size_t levelRatio = DEFAULT_LEVEL_RATIO, size_t numThreads = 1)
+                : filenamePrefix(std::move(filenamePrefix)), openFlags(openFlags),
+                  memtableBytes(memtableBytes), levelRatio(std::max(2ul, levelRatio)), numThreads(numThreads) {
+            readManifest();
+        }
+
+        ~LeveledObjectStore() {
+            try {
+                flush();
+                awaitCompaction();
+            } catch (const std::exception &e) {
+                std::cerr << "Unable to flush " << filenamePrefix << ": " << e.what() << std::endl;
+            }
+        }
+
+        void put(StoreConfig::key_t key, std::string_view value) {
+            if (isTombstone(value.data(), value.length())) {
+                throw std::invalid_argument("Value is reserved for tombstones");
+            }
+            insert(key, value);
+        }
+
+        void remove(StoreConfig::key_t key) {
+            insert(key, std::string_view(TOMBSTONE, TOMBSTONE_LENGTH));
+        }
+
+        /**
+         * Returns false if the key is not contained in the store.
+         */
+        bool get(StoreConfig::key_t key, std::string &value) {
+            auto it = memtable.find(key);
+            if (it != memtable.end()) {
+                if (isTombstone(it->second.data(), it->second.length())) {
+                    return false;
+                }
+                value = it->second;
+                return true;
+            }
+            std::vector<std::shared_ptr<Run>> runs;
+            {
+                std::lock_guard<std::mutex> lock(runsMutex);
+                runs.push_back(pending);
+                runs.insert(runs.end(), levels.begin(), levels.end());
+            }
+            for (std::shared_ptr<Run> &run : runs) {
+                if (run == nullptr) {
+                    continue;
+                }
+                QueryHandle *handle = run->query(key);
+                if (handle != nullptr) {
+                    if (isTombstone(handle->resultPtr, handle->length)) {
+                        return false;
+                    }
+                    value.assign(handle->resultPtr, handle->length);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * Write the in-memory table to a new run and start merging it into the levels in the background.
+         * Waits for the previous compaction, so that the number of runs stays bounded.
+         */
+        void flush() {
+            if (memtable.empty()) {
+                return;
+            }
+            awaitCompaction();
+            std::string filename = runFilename(nextRunId++);
+            std::shared_ptr<Run> run;
+            try {
+                LinearObjectWriter writer(filename.c_str(), openFlags);
+                writer.enableIndexFooter(a);
+                std::unique_ptr<KeyFilter> filter = std::make_unique<KeyFilter>(memtable.size());
+                for (auto &[key, value] : memtable) {
+                    writer.write(key, value.length(), value.data());
+                    filter->insert(key);
+                }
+                writer.close(VariableSizeObjectStore::StoreMetadata::TYPE_PACHASH);
+                run = std::make_shared<Run>(filename, openFlags, std::move(filter));
+            } catch (...) {
+                Run::removeFiles(filename);
+                throw;
+            }
+            bytesWritten += run->fileSize;
+            try {
+                writeManifest(run, levels);
+            } catch (...) {
+                run->obsolete = true; // Not listed in the manifest
+                throw;
+            }
+            {
+                std::lock_guard<std::mutex> lock(runsMutex);
+                pending = run;
+            }
+            memtable.clear();
+            memtableSize = 0;
+            startCompaction(run);
+        }
+
+        /**
+         * Rethrows the error if a compaction failed. The runs are then left as listed in the manifest,
+         * and the store can only be used again after reopening it.
+         */
+        void awaitCompaction() {
+            if (compactionThread.joinable()) {
+                compactionThread.join();
+            }
+            if (compactionError) {
+                std::rethrow_exception(compactionError);
+            }
+        }
+
+        [[nodiscard]] size_t numLevels() {
+            std::lock_guard<std::mutex> lock(runsMutex);
+            return levels.size();
+        }
+
+        /**
+         * Bytes written to runs, relative to the bytes of the objects that were put into the store.
+         */
+        [[nodiscard]] double writeAmplification() const {
+            return bytesInserted == 0 ? 0 : (double) bytesWritten / (double) bytesInserted;
+        }
+
+    private:
+        void insert(StoreConfig::key_t key, std::string_view value) {
+            assert(key != 0); // Key 0 holds metadata
+            auto [it, inserted] = memtable.try_emplace(key);
+            if (!inserted) {
+                memtableSize -= it->second.length() + VariableSizeObjectStore::overheadPerObject;
+            }
+            it->second = value;
+            memtableSize += value.length() + VariableSizeObjectStore::overheadPerObject;
+            bytesInserted += value.length() + sizeof(StoreConfig::key_t);
+            if (memtableSize >= memtableBytes) {
+                flush();
+            }
+        }
+
+        [[nodiscard]] size_t capacity(size_t level) const {
+            size_t result = memtableBytes;
+            for (size_t i = 0; i <= level; i++) {
+                result *= levelRatio;
+            }
+            return result;
+        }
+
+        std::string runFilename(size_t id) const {
+            return filenamePrefix + ".run" + std::to_string(id);
+        }
+
+        void startCompaction(std::shared_ptr<Run> run) {
+            compactionThread = std::thread([this, run] {
+                try {
+                    compact(run);
+                } catch (...) {
+                    compactionError = std::current_exception();
+                }
+            });
+        }
+
+        /**
+         * Merges the carried run into the first level. If the result exceeds the capacity of the level,
+         * it is carried on to the next level. All levels before the carried run are empty.
+         * Replaced runs are only deleted after the manifest no longer lists them. If a step fails,
+         * its output is deleted and the runs are left as listed in the manifest.
+         */
+        void compact(std::shared_ptr<Run> carry) {
+            std::vector<std::shared_ptr<Run>> newLevels;
+            {
+                std::lock_guard<std::mutex> lock(runsMutex);
+                newLevels = levels;
+            }
+            for (size_t level = 0; carry != nullptr; level++) {
+                if (level == newLevels.size()) {
+                    newLevels.emplace_back();
+                }
+                std::shared_ptr<Run> next = nullptr;
+                std::shared_ptr<Run> merged = nullptr;
+                std::vector<std::shared_ptr<Run>> replaced;
+                if (newLevels[level] == nullptr) {
+                    newLevels[level] = carry;
+                } else {
+                    bool isLastLevel = std::all_of(newLevels.begin() + level + 1, newLevels.end(),
+                            [](const std::shared_ptr<Run> &run) { return run == nullptr; });
+                    std::vector<std::string> inputs = {newLevels[level]->filename, carry->filename};
+                    std::string output = runFilename(nextRunId++);
+                    try {
+                        // Sized for the keys of both inputs, which is an upper bound for the output
+                        std::unique_ptr<KeyFilter> filter = std::make_unique<KeyFilter>(
+                                newLevels[level]->filter->numKeys + carry->filter->numKeys);
+                        merge(inputs, output, openFlags, a, MERGE_DEFAULT_READ_BUFFER, numThreads,
+                              isLastLevel ? MergeMode::NEWEST_WINS : MergeMode::NEWEST_WINS_KEEP_TOMBSTONES,
+                              [&](StoreConfig::key_t key) { filter->insert(key); });
+                        merged = std::make_shared<Run>(output, openFlags, std::move(filter));
+                    } catch (...) {
+                        Run::removeFiles(output);
+                        throw;
+                    }
+                    bytesWritten += merged->fileSize;
+                    replaced = {newLevels[level], carry};
+                    if (merged->fileSize > capacity(level)) {
+                        newLevels[level] = nullptr;
+                        next = merged;
+                    } else {
+                        newLevels[level] = merged;
+                    }
+                }
+                carry = next;
+                try {
+                    writeManifest(carry, newLevels);
+                } catch (...) {
+                    if (merged != nullptr) {
+                        merged->obsolete = true; // Not listed in the manifest
+                    }
+                    throw;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(runsMutex);
+                    pending = carry;
+                    levels = newLevels;
+                }
+                // Deleted when the last query that uses them is done
+                for (std::shared_ptr<Run> &run : replaced) {
+                    run->obsolete = true;
+                }
+            }
+        }
+
+        /**
+         * The manifest lists the next run id, the pending run and the run of each level. Empty entries are "-".
+         * It is replaced atomically by renaming.
+         */
+        void writeManifest(const std::shared_ptr<Run> &pendingRun, const std::vector<std::shared_ptr<Run>> &runs) {
+            std::string manifest = filenamePrefix + ".manifest";
+            std::string temporary = manifest + ".tmp";
+            {
+                std::ofstream out(temporary, std::ios::trunc);
+                out << nextRunId << "\n";
+                out << (pendingRun == nullptr ? "-" : pendingRun->filename) << "\n";
+                for (const std::shared_ptr<Run> &run : runs) {
+                    out << (run == nullptr ? "-" : run->filename) << "\n";
+                }
+                if (!out) {
+                    throw std::ios_base::failure("Unable to write " + temporary);
+                }
+            }
+            std::filesystem::rename(temporary, manifest);
+        }
+
+        void readManifest() {
+            std::ifstream in(filenamePrefix + ".manifest");
+            if (!in) {
+                return; // New store
+            }
+            size_t id;
+            in >> id;
+            nextRunId = id;
+            std::string filename;
+            in >> filename;
+            std::shared_ptr<Run> pendingRun = filename == "-" ? nullptr : std::make_shared<Run>(filename, openFlags);
+            while (in >> filename) {
+                levels.push_back(filename == "-" ? nullptr : std::make_shared<Run>(filename, openFlags));
+            }
+            if (pendingRun != nullptr) {
+                // Compaction was interrupted
+                pending = pendingRun;
+                startCompaction(pendingRun);
+            }
+        }
+};
+} // Namespace pachash
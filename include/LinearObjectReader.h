@@ -4,6 +4,8 @@ namespace pachash {
 template <bool reconstructObjects>
 class LinearObjectReader {
     public:
+        static constexpr size_t DEFAULT_READ_AHEAD_BLOCKS = 500;
+        static constexpr size_t READ_AHEAD_DEPTH = 4;
         size_t numBlocks = 0;
         size_t currentBlock = 0;
         size_t maxSize = 0;
@@ -12,32 +14,71 @@ class LinearObjectReader {
         size_t currentLength = 0;
     private:
         size_t currentElement = 0;
-        UringDoubleBufferBlockIterator blockIterator;
+        ReadAheadBlockIterator blockIterator;
         VariableSizeObjectStore::BlockStorage block;
         char* objectReconstructionBuffer = nullptr;
+        bool ended = false;
     public:
-        bool completed = false;
-        explicit LinearObjectReader(const char *filename, int flags)
+        /**
+         * Keeps up to readAheadBlocks blocks in memory, most of which are being read ahead of the current block.
+         * When starting at a firstBlock other than 0, an object must start on that block.
+         * Reading starts with that object.
+         */
+        explicit LinearObjectReader(const char *filename, int flags,
+                                    size_t readAheadBlocks = DEFAULT_READ_AHEAD_BLOCKS, size_t firstBlock = 0)
                 : numBlocks(VariableSizeObjectStore::readMetadata(filename).numBlocks),
+                currentBlock(firstBlock),
                 maxSize(VariableSizeObjectStore::readMetadata(filename).maxSize),
-                blockIterator(UringDoubleBufferBlockIterator(filename, numBlocks, 250, flags)) {
+                blockIterator(filename, numBlocks, batchSize(readAheadBlocks), READ_AHEAD_DEPTH, flags, firstBlock) {
             objectReconstructionBuffer = new char[maxSize];
             block = VariableSizeObjectStore::BlockStorage(blockIterator.blockContent());
-            next(); // Skip pseudo object 0
+            if (firstBlock == 0) {
+                next(); // Skip pseudo object 0
+            } else {
+                assert(block.numObjects > 0);
+                currentElement = -1;
+                next();
+            }
         }
 
         ~LinearObjectReader() {
             delete[] objectReconstructionBuffer;
         }
 
+        /**
+         * Memory that a reader allocates for its block buffers and object reconstruction.
+         */
+        static constexpr size_t memoryUsage(size_t maxSize, size_t readAheadBlocks = DEFAULT_READ_AHEAD_BLOCKS) {
+            return ReadAheadBlockIterator::memoryUsage(batchSize(readAheadBlocks), READ_AHEAD_DEPTH) + maxSize;
+        }
+
+        /**
+         * True if there is no current object, i.e., all objects were read.
+         */
         [[nodiscard]] bool hasEnded() const {
-            return currentBlock >= numBlocks - 1;
+            return ended;
         }
 
         void next() {
             assert(!hasEnded());
+            if (currentBlock >= numBlocks - 1 && currentElement + 1 >= block.numObjects) {
+                // Last object of the last block was already read
+                ended = true;
+                return;
+            }
             currentElement++;
             currentKey = block.keys[currentElement];
+            if (currentKey == 0) {
+                if (currentBlock >= numBlocks - 1) {
+                    // Terminator
+                    ended = true;
+                    return;
+                }
+                // Terminator of a block range that was written in parallel. The next block starts a new object.
+                nextBlock();
+                next();
+                return;
+            }
             if (currentElement < size_t(block.numObjects - 1)) {
                 // Object does not overlap. We already have the size
                 // and the pointer does not need reconstruction. All is nice and easy.
@@ -50,9 +91,6 @@ class LinearObjectReader {
                 assert(currentElement == size_t(block.numObjects - 1));
                 currentElementPointer = objectReconstructionBuffer;
                 currentLength = block.tableStart - block.blockStart - block.offsets[currentElement] - block.emptyPageEnd;
-                if (currentKey == 0) {
-                    return;
-                }
                 assert(currentLength <= maxSize);
                 if constexpr (reconstructObjects) {
                     memcpy(currentElementPointer, block.blockStart + block.offsets[currentElement], currentLength);
@@ -84,7 +122,42 @@ class LinearObjectReader {
                 return;
             }
         }
+
+        /**
+         * True if the current object is the first one that starts on the current block.
+         */
+        [[nodiscard]] bool atFirstObjectOfBlock() const {
+            return !ended && currentBlock < numBlocks && currentElement == 0;
+        }
+
+        /**
+         * Content of the block that is distance blocks behind the current one, without moving the reader.
+         * Returns nullptr if the block is behind the end of the file or not read ahead yet.
+         */
+        [[nodiscard]] char *peekBlock(size_t distance) {
+            if (currentBlock >= numBlocks || currentBlock + distance >= numBlocks) {
+                return nullptr;
+            }
+            return blockIterator.peek(distance);
+        }
+
+        /**
+         * Continue with the last object that starts on the block distance blocks behind the current one,
+         * without looking at the objects in between. That block must contain the start of an object.
+         */
+        void skipToLastObjectOfBlock(size_t distance) {
+            for (size_t i = 0; i < distance; i++) {
+                nextBlock();
+            }
+            assert(block.numObjects > 0);
+            currentElement = block.numObjects - 2;
+            next();
+        }
     private:
+        static constexpr size_t batchSize(size_t readAheadBlocks) {
+            return std::max(1ul, readAheadBlocks / READ_AHEAD_DEPTH);
+        }
+
         void nextBlock() {
             currentBlock++;
             blockIterator.next();
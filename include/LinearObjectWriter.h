@@ -1,125 +1,495 @@
 #pragma once
 
+#include "IndexFooter.h"
+#include "WritePipeline.h"
+#include "ValueSink.h"
+
 namespace pachash {
 class LinearObjectWriter {
     private:
-        static constexpr size_t BLOCK_FLUSH = 250;
         int fd;
         size_t numObjectsOnPage = 0;
         StoreConfig::key_t keys[StoreConfig::BLOCK_LENGTH / VariableSizeObjectStore::overheadPerObject] = {0};
         StoreConfig::offset_t offsets[StoreConfig::BLOCK_LENGTH / VariableSizeObjectStore::overheadPerObject] = {0};
         StoreConfig::offset_t spaceLeftOnBlock = StoreConfig::BLOCK_LENGTH - VariableSizeObjectStore::overheadPerBlock;
         size_t blockWritingPosition = 0;
+        size_t objectBytesLeft = 0;
         char *currentBlock = nullptr;
-        char *buffer1 = nullptr;
-        char *buffer2 = nullptr;
         size_t maxSize = 0;
-        #ifdef HAS_LIBURING
-        UringIO ioManager;
-        #else
-        PosixIO ioManager;
-        #endif
+        size_t firstBlock;
+        size_t maxBlocks;
+        IndexFooter::Recorder *indexRecorder = nullptr;
+        size_t indexBinsPerBlock = 0;
+        size_t blockSlack = 0;
+        bool appendingBlocks = false;
+        size_t appendedObjectBytes = 0; // Bytes of the last object of the appended blocks
+        WritePipeline pipeline;
     public:
+        static constexpr size_t MEMORY_USAGE = WritePipeline::memoryUsage();
+        /**
+         * The empty space at the end of a block is stored in one byte.
+         * finish() already leaves up to 128 bytes, so the slack of the other blocks is limited to the rest.
+         */
+        static constexpr size_t MAX_BLOCK_SLACK = 127;
         size_t blocksGenerated = 0;
 
-        explicit LinearObjectWriter(const char *filename, int flags)
-                : ioManager(filename, O_CREAT | flags, 2) {
+        /**
+         * Writes objects to the file, starting at block firstBlock.
+         * Only the writer starting at block 0 writes the space for the metadata.
+         * When maxBlocks is given, the writer stops producing output as soon as that number of blocks is completed.
+         * This makes it possible to let multiple writers fill disjoint block ranges of the same file.
+         * Up to writeQueueDepth - 1 writes are in flight while the next blocks are filled.
+         */
+        explicit LinearObjectWriter(const char *filename, int flags, size_t firstBlock = 0, size_t maxBlocks = ~0ul,
+                                    size_t writeQueueDepth = WritePipeline::DEFAULT_DEPTH)
+                : firstBlock(firstBlock), maxBlocks(maxBlocks), pipeline(filename, flags, writeQueueDepth) {
             fd = open(filename, O_RDWR | O_CREAT | flags, 0666);
             if (fd < 0) {
                 throw std::ios_base::failure("Unable to open " + std::string(filename)
                          + ": " + std::string(strerror(errno)));
             }
-            buffer1 = new (std::align_val_t(StoreConfig::BLOCK_LENGTH)) char[BLOCK_FLUSH * StoreConfig::BLOCK_LENGTH];
-            buffer2 = new (std::align_val_t(StoreConfig::BLOCK_LENGTH)) char[BLOCK_FLUSH * StoreConfig::BLOCK_LENGTH];
-            memset(buffer1, 0, BLOCK_FLUSH * StoreConfig::BLOCK_LENGTH);
-            memset(buffer2, 0, BLOCK_FLUSH * StoreConfig::BLOCK_LENGTH);
-            currentBlock = buffer1;
-            VariableSizeObjectStore::StoreMetadata metadataDummy = {};
-            write(0, sizeof(VariableSizeObjectStore::StoreMetadata), reinterpret_cast<const char *>(&metadataDummy));
+            currentBlock = pipeline.buffer();
+            if (firstBlock == 0) {
+                VariableSizeObjectStore::StoreMetadata metadataDummy = {};
+                write(0, sizeof(VariableSizeObjectStore::StoreMetadata), reinterpret_cast<const char *>(&metadataDummy));
+            }
         }
 
         ~LinearObjectWriter() {
-            delete[] buffer1;
-            delete[] buffer2;
+            ::close(fd);
+            delete indexRecorder;
+        }
+
+        /**
+         * Append an IndexFooter for the given number of bins per block when closing the file.
+         * Must be called before writing the first object.
+         * Writers of other block ranges than the first one only record their blocks,
+         * see IndexFooter::Recorder::append().
+         */
+        void enableIndexFooter(size_t binsPerBlock) {
+            assert(blocksGenerated == 0 && numObjectsOnPage == (firstBlock == 0 ? 1 : 0));
+            indexBinsPerBlock = binsPerBlock;
+            indexRecorder = new IndexFooter::Recorder();
+        }
+
+        /**
+         * Leave the given number of bytes empty at the end of every block.
+         * Objects that grow by up to that size can then be rewritten in place, see PaCHashObjectStore::updateInPlace.
+         * Must be called before writing the first object.
+         */
+        void enableBlockSlack(size_t bytes) {
+            assert(blocksGenerated == 0 && numObjectsOnPage == (firstBlock == 0 ? 1 : 0));
+            if (bytes > MAX_BLOCK_SLACK) {
+                throw std::invalid_argument("Block slack can be at most " + std::to_string(MAX_BLOCK_SLACK) + " bytes");
+            }
+            blockSlack = bytes;
+            spaceLeftOnBlock -= bytes;
         }
 
         void write(StoreConfig::key_t key, size_t length, const char* content) {
-            maxSize = std::max(maxSize, length);
-            size_t written = 0;
-            keys[numObjectsOnPage] = key;
-            offsets[numObjectsOnPage] = blockWritingPosition;
-            assert(blockWritingPosition <= StoreConfig::BLOCK_LENGTH);
-            numObjectsOnPage++;
-            spaceLeftOnBlock -= VariableSizeObjectStore::overheadPerObject;
+            startObject(key, length);
+            writeData(content, length);
+        }
 
-            do {
-                size_t toWrite = std::min(size_t(spaceLeftOnBlock), length - written);
-                memcpy(currentBlock + blockWritingPosition, content + written, toWrite);
-                blockWritingPosition += toWrite;
-                spaceLeftOnBlock -= toWrite;
-                written += toWrite;
+        /**
+         * Write an object whose content is appended to a sink by calling producer(sink).
+         * The pieces are copied directly to the block buffers and can span multiple blocks.
+         */
+        template <typename ValueProducer>
+        requires std::is_invocable_v<ValueProducer, ValueSink &>
+        void write(StoreConfig::key_t key, size_t length, ValueProducer producer) {
+            startObject(key, length);
+            WriterSink sink(*this, 0);
+            producer(sink);
+            if (length == 0) {
+                closeBlockIfFull();
+            }
+            assert((objectBytesLeft == 0 || blocksGenerated >= maxBlocks)
+                   && "Value producer did not append the declared length");
+        }
 
-                if (spaceLeftOnBlock <= VariableSizeObjectStore::overheadPerObject) {
-                    // No more object fits on the page.
-                    writeTable(false, spaceLeftOnBlock);
-                }
-            } while (written < length);
+        /**
+         * Continue writing an object that was started by another writer on a previous block.
+         * The table entry of the object is not written again.
+         */
+        void writeContinuation(size_t length, const char* content, size_t alreadyWritten) {
+            assert(blockWritingPosition == 0 && numObjectsOnPage == 0);
+            appendingBlocks = false;
+            maxSize = std::max(maxSize, length);
+            objectBytesLeft = length - alreadyWritten;
+            writeData(content + alreadyWritten, length - alreadyWritten);
         }
 
-        void writeTable(bool forceFlush, char emptySpace) {
+        template <typename ValueProducer>
+        requires std::is_invocable_v<ValueProducer, ValueSink &>
+        void writeContinuation(size_t length, ValueProducer producer, size_t alreadyWritten) {
+            assert(blockWritingPosition == 0 && numObjectsOnPage == 0);
+            appendingBlocks = false;
+            maxSize = std::max(maxSize, length);
+            objectBytesLeft = length - alreadyWritten;
+            WriterSink sink(*this, alreadyWritten);
+            producer(sink);
+        }
+
+        void writeTable(bool forceFlush, size_t emptySpace) {
             assert(blockWritingPosition <= StoreConfig::BLOCK_LENGTH);
             assert(numObjectsOnPage < StoreConfig::num_objects_t(~0) && "Increase StoreConfig::num_objects_t size");
             VariableSizeObjectStore::BlockStorage storage = VariableSizeObjectStore::BlockStorage::init(
-                    currentBlock, numObjectsOnPage, emptySpace);
+                    currentBlock, numObjectsOnPage, char(emptySpace + blockSlack));
             memcpy(&storage.offsets[0], &offsets[0], numObjectsOnPage * sizeof(StoreConfig::offset_t));
             memcpy(&storage.keys[0], &keys[0], numObjectsOnPage * sizeof(StoreConfig::key_t));
+            // Buffers are re-used, so clear the empty space to make the output deterministic
+            memset(currentBlock + blockWritingPosition, 0, storage.tableStart - currentBlock - blockWritingPosition);
+            completeBlock(numObjectsOnPage, forceFlush);
+        }
+
+        /**
+         * Append a block of another PaCHash file, for example of an input file of a merge.
+         * Consecutive calls copy the blocks verbatim, so objects can span them. Otherwise, the current block
+         * is closed first (see padToBlockBoundary()), and the end of an object at the start of the block
+         * is removed. That object must already be written completely and the removed part plus the empty space
+         * at the end of the block must fit into the emptyPageEnd byte.
+         * If the last object of the last appended block continues on the next block, the next call
+         * must be writeContinuation().
+         */
+        void writeBlock(const char *content) {
+            bool firstAppendedBlock = !appendingBlocks;
+            if (firstAppendedBlock) {
+                padToBlockBoundary();
+                appendingBlocks = true;
+                appendedObjectBytes = 0;
+            }
+            assert(blocksGenerated < maxBlocks);
+            memcpy(currentBlock, content, StoreConfig::BLOCK_LENGTH);
+            VariableSizeObjectStore::BlockStorage block(currentBlock);
+            size_t dataEnd = block.tableStart - block.blockStart - block.emptyPageEnd;
+            if (block.numObjects == 0) {
+                appendedObjectBytes += dataEnd;
+                completeBlock(0, false);
+                return;
+            }
+            if (firstAppendedBlock && block.offsets[0] > 0) {
+                size_t removed = block.offsets[0];
+                assert(block.emptyPageEnd + removed <= UINT8_MAX);
+                memmove(block.blockStart, block.blockStart + removed, dataEnd - removed);
+                memset(block.blockStart + dataEnd - removed, 0, removed);
+                for (size_t i = 0; i < block.numObjects; i++) {
+                    block.offsets[i] -= removed;
+                }
+                block.blockStart[StoreConfig::BLOCK_LENGTH - VariableSizeObjectStore::overheadPerBlock]
+                        = char(block.emptyPageEnd + removed);
+                dataEnd -= removed;
+            }
+            maxSize = std::max(maxSize, appendedObjectBytes + block.offsets[0]);
+            for (size_t i = 0; i < block.numObjects; i++) {
+                if (indexRecorder != nullptr) {
+                    indexRecorder->objectStarted(firstBlock + blocksGenerated, block.keys[i],
+                                                 i == 0 && block.offsets[0] == 0);
+                }
+                size_t end = i + 1 < block.numObjects ? block.offsets[i + 1] : dataEnd;
+                maxSize = std::max(maxSize, end - block.offsets[i]);
+            }
+            appendedObjectBytes = dataEnd - block.offsets[block.numObjects - 1];
+            completeBlock(block.numObjects, false);
+        }
+
+        /**
+         * Leave the rest of the current block empty, so that the next object starts on a new block.
+         * Must not be called while an object is being written.
+         */
+        void padToBlockBoundary() {
+            appendingBlocks = false;
+            if (atBlockBoundary()) {
+                return;
+            }
+            assert(objectBytesLeft == 0);
+            if (spaceLeftOnBlock <= 128) {
+                writeTable(false, spaceLeftOnBlock);
+            } else {
+                startObject(0, 0); // Terminator, the next block starts with a new object
+                writeTable(false, 42);
+            }
+        }
+
+        /**
+         * True if nothing was written to the current block yet.
+         */
+        [[nodiscard]] bool atBlockBoundary() const {
+            return numObjectsOnPage == 0 && blockWritingPosition == 0;
+        }
+
+    private:
+        void completeBlock(size_t tableEntries, bool forceFlush) {
+            if (indexRecorder != nullptr) {
+                indexRecorder->blockCompleted(tableEntries);
+            }
             numObjectsOnPage = 0;
             blocksGenerated++;
             currentBlock += StoreConfig::BLOCK_LENGTH;
             blockWritingPosition = 0;
-            spaceLeftOnBlock = StoreConfig::BLOCK_LENGTH - VariableSizeObjectStore::overheadPerBlock;
+            spaceLeftOnBlock = StoreConfig::BLOCK_LENGTH - VariableSizeObjectStore::overheadPerBlock - blockSlack;
 
-            if (currentBlock >= buffer1 + BLOCK_FLUSH * StoreConfig::BLOCK_LENGTH || forceFlush) {
-                // Flush
-                size_t generatedSinceLastFlush = blocksGenerated % BLOCK_FLUSH;
-                if (generatedSinceLastFlush == 0) {
-                    generatedSinceLastFlush = BLOCK_FLUSH;
-                }
-                size_t writeOffset = (blocksGenerated - generatedSinceLastFlush) * StoreConfig::BLOCK_LENGTH;
-                if (writeOffset != 0) {
-                    ioManager.awaitAny();
-                }
-                std::swap(buffer1, buffer2);
-                ioManager.enqueueWrite(buffer2, writeOffset, generatedSinceLastFlush * StoreConfig::BLOCK_LENGTH, 1);
-                ioManager.submit();
-                currentBlock = buffer1;
+            if (currentBlock >= pipeline.buffer() + pipeline.batchBlocks * StoreConfig::BLOCK_LENGTH || forceFlush) {
+                flush();
             }
         }
 
-        void close(uint16_t type) {
+    public:
+
+        /**
+         * Write all completed blocks that are still buffered.
+         */
+        void flush() {
+            size_t generatedSinceLastFlush = (currentBlock - pipeline.buffer()) / StoreConfig::BLOCK_LENGTH;
+            if (generatedSinceLastFlush == 0) {
+                return;
+            }
+            size_t writeOffset = (firstBlock + blocksGenerated - generatedSinceLastFlush) * StoreConfig::BLOCK_LENGTH;
+            pipeline.write(writeOffset, generatedSinceLastFlush);
+            currentBlock = pipeline.buffer();
+        }
+
+        /**
+         * Finish the last block and wait until all data is written.
+         * Does not write the metadata, so it can be used by the writer of the last block range.
+         * Writers that end a block range in the middle of the file must not truncate it.
+         */
+        void finish(bool truncateFile = true) {
             if (spaceLeftOnBlock <= 128) {
                 writeTable(true, spaceLeftOnBlock);
             } else {
                 // Needs a terminator for the very last element
-                write(0, 0, nullptr);
+                startObject(0, 0);
                 writeTable(true, 42);
             }
-            int result = ftruncate(fd, blocksGenerated * StoreConfig::BLOCK_LENGTH);
-            (void) result;
-            ioManager.awaitAny();
+            if (truncateFile) {
+                int result = ftruncate(fd, (firstBlock + blocksGenerated) * StoreConfig::BLOCK_LENGTH);
+                (void) result;
+            }
+            awaitWrites();
+        }
 
-            result = pread(fd, buffer1, StoreConfig::BLOCK_LENGTH, 0);
-            assert(result == StoreConfig::BLOCK_LENGTH);
-            VariableSizeObjectStore::BlockStorage firstBlock(buffer1);
-            assert(firstBlock.numObjects != 0);
+        void awaitWrites() {
+            pipeline.awaitAll();
+        }
+
+        void close(uint16_t type) {
+            finish();
             VariableSizeObjectStore::StoreMetadata metadata;
             metadata.numBlocks = blocksGenerated;
             metadata.maxSize = maxSize;
             metadata.type = type;
+            if (indexRecorder != nullptr) {
+                metadata.indexOffset = (firstBlock + blocksGenerated) * StoreConfig::BLOCK_LENGTH;
+                metadata.indexSize = IndexFooter::write(fd, metadata.indexOffset,
+                                                        indexRecorder->encode(blocksGenerated, indexBinsPerBlock));
+                metadata.indexBinsPerBlock = indexBinsPerBlock;
+            }
+            writeMetadata(fd, pipeline.buffer(), metadata);
+        }
+
+        [[nodiscard]] size_t maxObjectSize() const {
+            return maxSize;
+        }
+
+        /**
+         * Time spent waiting for the device because all write buffers were in flight, in nanoseconds.
+         */
+        [[nodiscard]] size_t writeStallNanoseconds() const {
+            return pipeline.writeStallNanoseconds();
+        }
+
+        /**
+         * Information about the written blocks that the index is built from. See enableIndexFooter().
+         */
+        [[nodiscard]] const IndexFooter::Recorder &indexFooterRecorder() const {
+            assert(indexRecorder != nullptr);
+            return *indexRecorder;
+        }
+
+        /**
+         * Fill in the metadata of a file that was written by one or more writers.
+         */
+        static void writeMetadata(const char *filename, int flags, VariableSizeObjectStore::StoreMetadata &metadata) {
+            int fd = open(filename, O_RDWR | flags);
+            if (fd < 0) {
+                throw std::ios_base::failure("Unable to open " + std::string(filename)
+                         + ": " + std::string(strerror(errno)));
+            }
+            char *buffer = new (std::align_val_t(StoreConfig::BLOCK_LENGTH)) char[StoreConfig::BLOCK_LENGTH];
+            writeMetadata(fd, buffer, metadata);
+            delete[] buffer;
+            ::close(fd);
+        }
+
+    private:
+        /**
+         * Appends the pieces of a produced value to the current object.
+         * Skips the part that was already written by the writer of the previous block range.
+         */
+        class WriterSink : public ValueSink {
+            private:
+                LinearObjectWriter &writer;
+                size_t bytesToSkip;
+            public:
+                WriterSink(LinearObjectWriter &writer, size_t bytesToSkip)
+                        : writer(writer), bytesToSkip(bytesToSkip) {
+                }
+
+                void append(const char *data, size_t length) final {
+                    if (bytesToSkip >= length) {
+                        bytesToSkip -= length;
+                        return;
+                    }
+                    writer.writeData(data + bytesToSkip, length - bytesToSkip);
+                    bytesToSkip = 0;
+                }
+        };
+
+        void startObject(StoreConfig::key_t key, size_t length) {
+            appendingBlocks = false;
+            if (indexRecorder != nullptr) {
+                indexRecorder->objectStarted(firstBlock + blocksGenerated, key,
+                                             numObjectsOnPage == 0 && blockWritingPosition == 0);
+            }
+            maxSize = std::max(maxSize, length);
+            keys[numObjectsOnPage] = key;
+            offsets[numObjectsOnPage] = blockWritingPosition;
+            assert(blockWritingPosition <= StoreConfig::BLOCK_LENGTH);
+            numObjectsOnPage++;
+            spaceLeftOnBlock -= VariableSizeObjectStore::overheadPerObject;
+            objectBytesLeft = length;
+        }
+
+        /**
+         * Append the next length bytes of the current object.
+         */
+        void writeData(const char* content, size_t length) {
+            if (blocksGenerated >= maxBlocks) {
+                return; // The rest of the object belongs to the block range of the next writer
+            }
+            assert(length <= objectBytesLeft);
+            size_t written = 0;
+            do {
+                size_t toWrite = std::min(size_t(spaceLeftOnBlock), length - written);
+                memcpy(currentBlock + blockWritingPosition, content + written, toWrite);
+                blockWritingPosition += toWrite;
+                spaceLeftOnBlock -= toWrite;
+                written += toWrite;
+                objectBytesLeft -= toWrite;
+                closeBlockIfFull();
+            } while (written < length && blocksGenerated < maxBlocks);
+        }
+
+        void closeBlockIfFull() {
+            if (spaceLeftOnBlock == 0 || (objectBytesLeft == 0
+                    && spaceLeftOnBlock <= VariableSizeObjectStore::overheadPerObject)) {
+                // No more object fits on the page.
+                writeTable(false, spaceLeftOnBlock);
+            }
+        }
+
+        static void writeMetadata(int fd, char *buffer, VariableSizeObjectStore::StoreMetadata &metadata) {
+            int result = pread(fd, buffer, StoreConfig::BLOCK_LENGTH, 0);
+            assert(result == StoreConfig::BLOCK_LENGTH);
+            VariableSizeObjectStore::BlockStorage firstBlock(buffer);
+            assert(firstBlock.numObjects != 0);
             memcpy(firstBlock.blockStart, &metadata, sizeof(VariableSizeObjectStore::StoreMetadata));
-            result = pwrite(fd, buffer1, StoreConfig::BLOCK_LENGTH, 0);
+            result = pwrite(fd, buffer, StoreConfig::BLOCK_LENGTH, 0);
             assert(result == StoreConfig::BLOCK_LENGTH);
-            ::close(fd);
+            (void) result;
+        }
+};
+
+/**
+ * Determines the block layout that LinearObjectWriter produces for a sequence of keys and object sizes,
+ * without touching any data. Remembers where every CHUNK_BLOCKS-th block starts,
+ * so that multiple writers can resume writing at these blocks in parallel.
+ */
+class LinearObjectLayout {
+    public:
+        static constexpr size_t CHUNK_BLOCKS = 64;
+        struct BlockStart {
+            size_t object = 0; // First object with data on the block
+            size_t alreadyWritten = 0; // Bytes of that object that are located on previous blocks
+        };
+        std::vector<BlockStart> chunkStarts;
+        size_t numBlocks = 0;
+        size_t maxSize = 0;
+        size_t totalPayloadSize = 0;
+    private:
+        size_t spaceLeftOnBlock = 0;
+        size_t numObjects = 0;
+        size_t blocksGenerated = 0;
+        size_t numObjectsOnBlock = 1;
+        size_t blockCapacity;
+    public:
+        IndexFooter::Recorder indexRecorder;
+
+        /**
+         * Layouts of block ranges that do not start at the beginning of the file have no metadata object.
+         * The block slack has to match LinearObjectWriter::enableBlockSlack().
+         */
+        explicit LinearObjectLayout(bool withMetadata = true, size_t blockSlack = 0)
+                : blockCapacity(StoreConfig::BLOCK_LENGTH - VariableSizeObjectStore::overheadPerBlock - blockSlack) {
+            if (blockSlack > LinearObjectWriter::MAX_BLOCK_SLACK) {
+                throw std::invalid_argument("Block slack can be at most "
+                        + std::to_string(LinearObjectWriter::MAX_BLOCK_SLACK) + " bytes");
+            }
+            spaceLeftOnBlock = blockCapacity;
+            chunkStarts.push_back({0, 0});
+            if (withMetadata) {
+                maxSize = sizeof(VariableSizeObjectStore::StoreMetadata);
+                spaceLeftOnBlock -= VariableSizeObjectStore::overheadPerObject
+                        + sizeof(VariableSizeObjectStore::StoreMetadata);
+            } else {
+                numObjectsOnBlock = 0;
+            }
+        }
+
+        void add(StoreConfig::key_t key, size_t length) {
+            maxSize = std::max(maxSize, length);
+            totalPayloadSize += length;
+            size_t written = 0;
+            indexRecorder.objectStarted(blocksGenerated, key, spaceLeftOnBlock == blockCapacity);
+            numObjectsOnBlock++;
+            spaceLeftOnBlock -= VariableSizeObjectStore::overheadPerObject;
+            do {
+                size_t toWrite = std::min(spaceLeftOnBlock, length - written);
+                spaceLeftOnBlock -= toWrite;
+                written += toWrite;
+                if (spaceLeftOnBlock <= VariableSizeObjectStore::overheadPerObject) {
+                    if (written < length) {
+                        closeBlock({numObjects, written});
+                    } else {
+                        closeBlock({numObjects + 1, 0});
+                    }
+                }
+            } while (written < length);
+            numObjects++;
+        }
+
+        void close() {
+            // Both cases of LinearObjectWriter::finish() generate exactly one more block
+            if (spaceLeftOnBlock > 128) {
+                numObjectsOnBlock++; // Terminator
+            }
+            indexRecorder.blockCompleted(numObjectsOnBlock);
+            numBlocks = blocksGenerated + 1;
+            while (!chunkStarts.empty() && (chunkStarts.size() - 1) * CHUNK_BLOCKS >= numBlocks) {
+                chunkStarts.pop_back();
+            }
+        }
+
+    private:
+        void closeBlock(BlockStart nextBlock) {
+            indexRecorder.blockCompleted(numObjectsOnBlock);
+            numObjectsOnBlock = 0;
+            blocksGenerated++;
+            spaceLeftOnBlock = blockCapacity;
+            if (blocksGenerated % CHUNK_BLOCKS == 0) {
+                chunkStarts.push_back(nextBlock);
+            }
         }
 };
 
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cassert>
+#include <vector>
+#include "StoreConfig.h"
+
+namespace pachash {
+/**
+ * Tournament tree that selects the source with the smallest key among k sources.
+ * Each inner node stores the loser of the comparison at that node, the overall winner is kept separately.
+ * Replacing the key of the winner only replays the comparisons on the path from its leaf to the root,
+ * so selecting the next minimum needs log(k) comparisons instead of a scan over all sources.
+ * Sources that ran out of keys are deactivated and lose against all active sources.
+ * If multiple sources have the same key, they win one after another, starting with the largest index.
+ */
+class LoserTree {
+    private:
+        size_t numLeaves;
+        std::vector<size_t> losers;
+        std::vector<StoreConfig::key_t> keys;
+        std::vector<bool> active;
+        size_t winnerSource = 0;
+    public:
+        /**
+         * Initialize the tree with the first key of each source.
+         * Sources with active[i] == false have no keys.
+         */
+        LoserTree(const std::vector<StoreConfig::key_t> &initialKeys, const std::vector<bool> &initialActive) {
+            assert(initialKeys.size() == initialActive.size());
+            numLeaves = 1;
+            while (numLeaves < initialKeys.size()) {
+                numLeaves *= 2;
+            }
+            keys = initialKeys;
+            keys.resize(numLeaves, 0);
+            active = initialActive;
+            active.resize(numLeaves, false);
+            losers.resize(numLeaves);
+            winnerSource = build(1);
+        }
+
+        /**
+         * Source with the smallest key. Only valid if empty() is false.
+         */
+        [[nodiscard]] size_t winner() const {
+            return winnerSource;
+        }
+
+        /**
+         * True if all sources were deactivated.
+         */
+        [[nodiscard]] bool empty() const {
+            return !active[winnerSource];
+        }
+
+        /**
+         * The winner advanced to its next key.
+         */
+        void replaceWinner(StoreConfig::key_t key) {
+            keys[winnerSource] = key;
+            replay();
+        }
+
+        /**
+         * The winner has no more keys.
+         */
+        void deactivateWinner() {
+            active[winnerSource] = false;
+            replay();
+        }
+
+    private:
+        /**
+         * True if source a wins against source b. For equal keys, the source with the larger index wins.
+         */
+        [[nodiscard]] inline bool wins(size_t a, size_t b) const {
+            if (active[a] != active[b]) {
+                return active[a];
+            }
+            return keys[a] < keys[b] || (keys[a] == keys[b] && a > b);
+        }
+
+        size_t build(size_t node) {
+            if (node >= numLeaves) {
+                return node - numLeaves;
+            }
+            size_t left = build(2 * node);
+            size_t right = build(2 * node + 1);
+            if (wins(left, right)) {
+                losers[node] = right;
+                return left;
+            } else {
+                losers[node] = left;
+                return right;
+            }
+        }
+
+        void replay() {
+            size_t candidate = winnerSource;
+            for (size_t node = (numLeaves + winnerSource) / 2; node > 0; node /= 2) {
+                if (wins(losers[node], candidate)) {
+                    std::swap(losers[node], candidate);
+                }
+            }
+            winnerSource = candidate;
+        }
+};
+} // Namespace pachash
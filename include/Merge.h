@@ -1,52 +1,533 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include "VariableSizeObjectStore.h"
+#include "LinearObjectWriter.h"
+#include "BlockIterator.h"
 #include "LinearObjectReader.h"
+#include "LoserTree.h"
 
 namespace pachash {
-void merge(std::vector<std::string> &inputFiles, std::string &outputFile) {
-    std::vector<LinearObjectReader<true>> readers;
+static constexpr size_t MERGE_DEFAULT_READ_BUFFER = 256 * 1024 * 1024;
+static constexpr size_t MERGE_MIN_READ_AHEAD_BLOCKS = 32;
+static constexpr size_t MERGE_MAX_READ_AHEAD_BLOCKS = 1000;
+static constexpr size_t MERGE_DEFAULT_MIN_COPY_BLOCKS = 32;
+
+/**
+ * How keys that occur in multiple inputs are handled.
+ * DISJOINT: Keys must not occur in multiple inputs. Merging throws std::invalid_argument if they do.
+ * NEWEST_WINS: Inputs are ordered from oldest to newest. Only the newest object of each key is kept,
+ *     and keys whose newest object is a tombstone are removed. Use this to apply deltas to a store.
+ * NEWEST_WINS_KEEP_TOMBSTONES: Like NEWEST_WINS, but tombstones are kept. Use this to combine deltas.
+ */
+enum class MergeMode {
+    DISJOINT, NEWEST_WINS, NEWEST_WINS_KEEP_TOMBSTONES
+};
+
+/**
+ * Value of an object that marks its key as deleted.
+ */
+static constexpr char TOMBSTONE[] = "\0PaCHash tombstone";
+static constexpr size_t TOMBSTONE_LENGTH = sizeof(TOMBSTONE) - 1;
+
+inline bool isTombstone(const char *value, size_t length) {
+    return length == TOMBSTONE_LENGTH && memcmp(value, TOMBSTONE, TOMBSTONE_LENGTH) == 0;
+}
+
+/**
+ * Number of blocks that each of numInputs readers reads ahead when sharing readBufferBytes.
+ * With few inputs, the device is kept busy by deep read-ahead.
+ * With many inputs, the requests of all readers together keep it busy.
+ */
+constexpr size_t mergeReadAheadBlocks(size_t numInputs, size_t readBufferBytes) {
+    size_t blocks = readBufferBytes / std::max(1ul, numInputs) / StoreConfig::BLOCK_LENGTH;
+    return std::clamp(blocks, MERGE_MIN_READ_AHEAD_BLOCKS, MERGE_MAX_READ_AHEAD_BLOCKS);
+}
+
+/**
+ * Block from which a file has to be read to get all objects with a key of at least startKey.
+ * Keys are sorted, so this is a binary search over the first key that starts on each block.
+ * Only reads a logarithmic number of blocks, plus the blocks that no object starts on.
+ */
+inline size_t findFirstBlockOfKeyRange(const char *filename, int openFlags, size_t numBlocks,
+                                       StoreConfig::key_t startKey) {
+    int fd = open(filename, O_RDONLY | openFlags);
+    if (fd < 0) {
+        throw std::ios_base::failure("Unable to open " + std::string(filename)
+                 + ": " + std::string(strerror(errno)));
+    }
+    char *buffer = new (std::align_val_t(StoreConfig::BLOCK_LENGTH)) char[StoreConfig::BLOCK_LENGTH];
+    // Key 0 means that no object starts on the block or that the block range ends with a terminator
+    auto firstKeyOfBlock = [&](size_t blockIdx) {
+        ssize_t result = pread(fd, buffer, StoreConfig::BLOCK_LENGTH, blockIdx * StoreConfig::BLOCK_LENGTH);
+        if (result != ssize_t(StoreConfig::BLOCK_LENGTH)) {
+            throw std::ios_base::failure("Unable to read block of " + std::string(filename));
+        }
+        VariableSizeObjectStore::BlockStorage block(buffer);
+        return block.numObjects == 0 ? StoreConfig::key_t(0) : block.keys[0];
+    };
+    // Block 0 starts with the metadata object, so all objects with smaller keys are located before block `hi`
+    size_t lo = 0;
+    size_t hi = numBlocks;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        size_t probe = mid;
+        StoreConfig::key_t key = 0;
+        while (probe < hi && (key = firstKeyOfBlock(probe)) == 0) {
+            probe++;
+        }
+        if (probe < hi && key < startKey) {
+            lo = probe;
+        } else {
+            hi = mid;
+        }
+    }
+    operator delete[](buffer, std::align_val_t(StoreConfig::BLOCK_LENGTH));
+    close(fd);
+    return lo;
+}
+
+/**
+ * Block copy function for mergeKeyRange that merges all objects individually.
+ */
+struct NoBlockCopy {
+};
+
+/**
+ * Number of blocks of the reader, starting with the current one, that can be taken over as a whole
+ * because all objects starting on them have a key of at most maxKey.
+ * Only counts up to the last block that an object starts on, and only blocks that are already read ahead.
+ * With removeContinuation, the end of an object at the start of the current block needs to fit into its
+ * empty space, see LinearObjectWriter::writeBlock().
+ */
+inline size_t copyableBlocks(LinearObjectReader<true> &reader, StoreConfig::key_t maxKey, bool dropTombstones,
+                             bool removeContinuation) {
+    size_t blocks = 0;
+    for (size_t distance = 0; ; distance++) {
+        char *content = reader.peekBlock(distance);
+        if (content == nullptr) {
+            return blocks;
+        }
+        VariableSizeObjectStore::BlockStorage block(content);
+        if (block.numObjects == 0) {
+            continue; // Fully overlapped by an object
+        }
+        if (distance == 0 && removeContinuation && block.offsets[0] + block.emptyPageEnd > UINT8_MAX) {
+            return 0;
+        }
+        size_t numObjects = block.numObjects;
+        if (block.keys[numObjects - 1] == 0 && numObjects > 1) {
+            numObjects--; // Terminator of a block range that was written in parallel
+        }
+        if (block.keys[numObjects - 1] > maxKey) {
+            return blocks;
+        }
+        if (dropTombstones) {
+            size_t dataEnd = block.tableStart - block.blockStart - block.emptyPageEnd;
+            for (size_t i = 0; i < numObjects; i++) {
+                const char *value = block.blockStart + block.offsets[i];
+                if (i + 1 < block.numObjects) {
+                    if (isTombstone(value, block.offsets[i + 1] - block.offsets[i])) {
+                        return blocks;
+                    }
+                } else if (dataEnd - block.offsets[i] <= TOMBSTONE_LENGTH
+                        && memcmp(value, TOMBSTONE, dataEnd - block.offsets[i]) == 0) {
+                    return blocks; // Might be a tombstone that continues on the next block
+                }
+            }
+        }
+        blocks = distance + 1;
+    }
+}
+
+/**
+ * Block copy function for mergeKeyRange that appends the blocks it takes over to a writer,
+ * see LinearObjectWriter::writeBlock().
+ * Starting to copy leaves the current output block partially empty, so this only starts for runs of at least
+ * minCopyBlocks blocks. A run ends with the last object that starts on it, and the rest of that object
+ * is written normally.
+ */
+class BlockCopier {
+    private:
+        LinearObjectWriter &writer;
+        size_t minCopyBlocks;
+        bool dropTombstones;
+    public:
+        size_t copiedBlocks = 0;
+
+        BlockCopier(LinearObjectWriter &writer, size_t minCopyBlocks, bool dropTombstones)
+                : writer(writer), minCopyBlocks(minCopyBlocks), dropTombstones(dropTombstones) {
+        }
+
+        bool operator()(LinearObjectReader<true> &reader, StoreConfig::key_t maxKey) {
+            size_t blocks = copyableBlocks(reader, maxKey, dropTombstones, true);
+            if (blocks == 0 || (blocks < minCopyBlocks && !writer.atBlockBoundary())) {
+                return false;
+            }
+            while (true) {
+                for (size_t i = 0; i < blocks; i++) {
+                    writer.writeBlock(reader.peekBlock(i));
+                }
+                copiedBlocks += blocks;
+                VariableSizeObjectStore::BlockStorage lastBlock(reader.peekBlock(blocks - 1));
+                if (lastBlock.keys[lastBlock.numObjects - 1] == 0) {
+                    // Terminator, the reader moves on to the first object of the next block
+                    reader.skipToLastObjectOfBlock(blocks - 1);
+                    return true;
+                }
+                size_t lastBlockIdx = reader.currentBlock + blocks - 1;
+                size_t alreadyWritten = lastBlock.tableStart - lastBlock.blockStart - lastBlock.emptyPageEnd
+                        - lastBlock.offsets[lastBlock.numObjects - 1];
+                reader.skipToLastObjectOfBlock(blocks - 1);
+                if (reader.currentBlock == lastBlockIdx + 1) {
+                    // The object ends on the next block. If that block can be copied as well, the run continues.
+                    blocks = copyableBlocks(reader, maxKey, dropTombstones, false);
+                    if (blocks > 0) {
+                        continue;
+                    }
+                }
+                writer.writeContinuation(reader.currentLength, reader.currentElementPointer, alreadyWritten);
+                reader.next();
+                return true;
+            }
+        }
+};
+
+/**
+ * Calls output(reader) for each object with a key in [firstKey, lastKey] of all input files, in key order.
+ * Reading each input starts at the given block, which must not be located behind the first object of the range.
+ * Tombstones can only be detected when reconstructing objects.
+ * When the next object is the first one that starts on its block, blockCopy(reader, maxKey) can take over
+ * the following blocks of that input if their keys are at most maxKey.
+ * It then moves the reader to the first object it did not take over and returns true.
+ */
+template <bool reconstructObjects, typename Output, typename BlockCopy = NoBlockCopy>
+void mergeKeyRange(const std::vector<std::string> &inputFiles, const std::vector<size_t> &firstBlocks,
+                   int openFlags, size_t readAheadBlocks, StoreConfig::key_t firstKey, StoreConfig::key_t lastKey,
+                   MergeMode mode, Output output, BlockCopy blockCopy = BlockCopy()) {
+    assert(reconstructObjects || mode != MergeMode::NEWEST_WINS);
+    std::vector<LinearObjectReader<reconstructObjects>> readers;
     readers.reserve(inputFiles.size());
-    size_t totalBlocks = 0;
+    std::vector<StoreConfig::key_t> initialKeys;
+    std::vector<bool> initialActive;
+    for (size_t i = 0; i < inputFiles.size(); i++) {
+        LinearObjectReader<reconstructObjects> &reader = readers.emplace_back(
+                inputFiles[i].c_str(), openFlags, readAheadBlocks, firstBlocks[i]);
+        while (!reader.hasEnded() && reader.currentKey < firstKey) {
+            reader.next();
+        }
+        initialKeys.push_back(reader.currentKey);
+        initialActive.push_back(!reader.hasEnded() && reader.currentKey <= lastKey);
+    }
+
+    LoserTree tree(initialKeys, initialActive);
+    auto updateWinner = [&] {
+        LinearObjectReader<reconstructObjects> &reader = readers[tree.winner()];
+        if (reader.hasEnded() || reader.currentKey > lastKey) {
+            tree.deactivateWinner();
+        } else {
+            tree.replaceWinner(reader.currentKey);
+        }
+    };
+    auto advanceWinner = [&] {
+        readers[tree.winner()].next();
+        updateWinner();
+    };
+    while (!tree.empty()) {
+        LinearObjectReader<reconstructObjects> &minReader = readers[tree.winner()];
+        StoreConfig::key_t key = minReader.currentKey;
+        if constexpr (!std::is_same_v<BlockCopy, NoBlockCopy>) {
+            if (minReader.atFirstObjectOfBlock()) {
+                // Objects of the other inputs that come before the next key of this input
+                StoreConfig::key_t maxKey = lastKey;
+                for (size_t i = 0; i < readers.size(); i++) {
+                    if (i != tree.winner() && !readers[i].hasEnded() && readers[i].currentKey <= maxKey) {
+                        maxKey = readers[i].currentKey - 1;
+                    }
+                }
+                if (blockCopy(minReader, maxKey)) {
+                    updateWinner();
+                    continue;
+                }
+            }
+        }
+        if (mode != MergeMode::NEWEST_WINS || !isTombstone(minReader.currentElementPointer, minReader.currentLength)) {
+            output(minReader);
+        }
+        advanceWinner();
+        if (mode == MergeMode::DISJOINT) {
+            if (!tree.empty() && readers[tree.winner()].currentKey == key) {
+                throw std::invalid_argument("Key " + std::to_string(key) + " occurs in multiple inputs");
+            }
+            continue;
+        }
+        // Equal keys win starting with the newest input, so the remaining ones are outdated
+        while (!tree.empty() && readers[tree.winner()].currentKey == key) {
+            advanceWinner();
+        }
+    }
+}
+
+/**
+ * Splits the key space into numThreads ranges that are merged in parallel.
+ * The number of blocks of each range is determined by a first pass that only reads keys and lengths,
+ * so that every range can then be written to its exact position in the output file.
+ * Each range starts on a new block. All ranges but the last one end with a terminator if the last block
+ * has too much empty space, which LinearObjectReader and the index construction skip.
+ * The keyObserver is called concurrently by the threads, each for the keys of its own range.
+ */
+inline void mergeParallel(std::vector<std::string> &inputFiles, std::string &outputFile, int openFlags,
+                          size_t indexBinsPerBlock, size_t readBufferBytes, size_t numThreads, MergeMode mode,
+                          const std::function<void(StoreConfig::key_t)> &keyObserver = nullptr) {
+    size_t numInputs = inputFiles.size();
+    std::vector<size_t> inputBlocks;
     for (const std::string& inputFile : inputFiles) {
-        readers.emplace_back(inputFile.c_str(), O_DIRECT);
-        totalBlocks += readers.back().numBlocks;
+        inputBlocks.push_back(VariableSizeObjectStore::readMetadata(inputFile.c_str()).numBlocks);
+    }
+    size_t readAheadBlocks = mergeReadAheadBlocks(numInputs * numThreads, readBufferBytes);
+
+    std::vector<StoreConfig::key_t> firstKeyOfRange(numThreads + 1);
+    std::vector<std::vector<size_t>> firstBlocksOfRange(numThreads, std::vector<size_t>(numInputs, 0));
+    for (size_t range = 1; range < numThreads; range++) {
+        firstKeyOfRange[range] = (~StoreConfig::key_t(0) / numThreads) * range;
+        for (size_t i = 0; i < numInputs; i++) {
+            firstBlocksOfRange[range][i] = findFirstBlockOfKeyRange(inputFiles[i].c_str(), openFlags,
+                                                                    inputBlocks[i], firstKeyOfRange[range]);
+        }
+    }
+    firstKeyOfRange[0] = 1; // Key 0 holds metadata
+    firstKeyOfRange[numThreads] = 0; // Wraps around, the last range ends at the largest key
+    auto forEachRangeParallel = [&](auto function) {
+        std::vector<std::exception_ptr> errors(numThreads);
+        std::vector<std::thread> threads;
+        threads.reserve(numThreads);
+        for (size_t range = 0; range < numThreads; range++) {
+            threads.emplace_back([&, range] {
+                try {
+                    function(range, firstKeyOfRange[range], firstKeyOfRange[range + 1] - 1);
+                } catch (...) {
+                    errors[range] = std::current_exception();
+                }
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        for (std::exception_ptr &error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    };
+
+    LOG("Determining layout");
+    std::vector<size_t> blocksOfRange(numThreads, 0);
+    forEachRangeParallel([&](size_t range, StoreConfig::key_t firstKey, StoreConfig::key_t lastKey) {
+        LinearObjectLayout layout(range == 0);
+        size_t objects = 0;
+        auto addToLayout = [&](auto &reader) {
+            layout.add(reader.currentKey, reader.currentLength);
+            objects++;
+        };
+        if (mode == MergeMode::NEWEST_WINS) {
+            mergeKeyRange<true>(inputFiles, firstBlocksOfRange[range], openFlags, readAheadBlocks,
+                                firstKey, lastKey, mode, addToLayout);
+        } else {
+            mergeKeyRange<false>(inputFiles, firstBlocksOfRange[range], openFlags, readAheadBlocks,
+                                 firstKey, lastKey, mode, addToLayout);
+        }
+        if (range == 0 || objects > 0) {
+            layout.close();
+            blocksOfRange[range] = layout.numBlocks;
+        }
+    });
+    std::vector<size_t> firstBlockOfRange(numThreads + 1, 0);
+    for (size_t range = 0; range < numThreads; range++) {
+        firstBlockOfRange[range + 1] = firstBlockOfRange[range] + blocksOfRange[range];
     }
+    size_t numBlocks = firstBlockOfRange[numThreads];
 
-    LinearObjectWriter writer(outputFile.c_str(), O_DIRECT);
-    size_t readersCompleted = 0;
-    size_t totalObjects = 0;
-    size_t numReaders = readers.size();
+    int fd = open(outputFile.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        throw std::ios_base::failure("Unable to open " + outputFile + ": " + std::string(strerror(errno)));
+    }
+    // If the file is a partition, truncating fails, so we silently ignore the result
+    int result = ftruncate(fd, numBlocks * StoreConfig::BLOCK_LENGTH);
+    (void) result;
+    result = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, numBlocks * StoreConfig::BLOCK_LENGTH);
+    (void) result;
 
-    while (readersCompleted < numReaders) {
-        size_t minimumReader = -1;
-        size_t minimumLength = -1;
-        StoreConfig::key_t minimumKey = ~0;
-        for (size_t i = 0; i < numReaders; i++) {
-            LinearObjectReader<true> &reader = readers[i];
-            if (reader.completed) {
-                continue;
+    LOG("Merging");
+    std::vector<IndexFooter::Recorder> recorderOfRange(numThreads);
+    std::vector<size_t> maxSizeOfRange(numThreads, 0);
+    forEachRangeParallel([&](size_t range, StoreConfig::key_t firstKey, StoreConfig::key_t lastKey) {
+        if (blocksOfRange[range] == 0) {
+            return;
+        }
+        LinearObjectWriter writer(outputFile.c_str(), openFlags, firstBlockOfRange[range]);
+        if (indexBinsPerBlock > 0) {
+            writer.enableIndexFooter(indexBinsPerBlock);
+        }
+        mergeKeyRange<true>(inputFiles, firstBlocksOfRange[range], openFlags, readAheadBlocks, firstKey, lastKey, mode,
+                            [&](LinearObjectReader<true> &reader) {
+            writer.write(reader.currentKey, reader.currentLength, reader.currentElementPointer);
+            if (keyObserver) {
+                keyObserver(reader.currentKey);
             }
-            StoreConfig::key_t currentKey = reader.currentKey;
-            assert(currentKey != minimumKey && "Key collision");
-            if (currentKey < minimumKey) {
-                minimumKey = currentKey;
-                minimumReader = i;
-                minimumLength = reader.currentLength;
+        });
+        writer.finish(false);
+        assert(writer.blocksGenerated == blocksOfRange[range]);
+        if (indexBinsPerBlock > 0) {
+            recorderOfRange[range] = writer.indexFooterRecorder();
+        }
+        maxSizeOfRange[range] = writer.maxObjectSize();
+    });
+
+    VariableSizeObjectStore::StoreMetadata metadata;
+    metadata.numBlocks = numBlocks;
+    metadata.maxSize = *std::max_element(maxSizeOfRange.begin(), maxSizeOfRange.end());
+    metadata.type = VariableSizeObjectStore::StoreMetadata::TYPE_PACHASH;
+    if (indexBinsPerBlock > 0) {
+        IndexFooter::Recorder &recorder = recorderOfRange[0];
+        for (size_t range = 1; range < numThreads; range++) {
+            if (blocksOfRange[range] > 0) {
+                recorder.append(recorderOfRange[range]);
             }
         }
+        metadata.indexOffset = numBlocks * StoreConfig::BLOCK_LENGTH;
+        metadata.indexSize = IndexFooter::write(fd, metadata.indexOffset, recorder.encode(numBlocks, indexBinsPerBlock));
+        metadata.indexBinsPerBlock = indexBinsPerBlock;
+    }
+    close(fd);
+    LinearObjectWriter::writeMetadata(outputFile.c_str(), openFlags, metadata);
+    LOG(nullptr);
+}
 
-        LinearObjectReader<true> &minReader = readers[minimumReader];
-        writer.write(minimumKey, minimumLength, minReader.currentElementPointer);
-        totalObjects++;
+/**
+ * Like the sequential merge(), but copies blocks of an input as a whole if no other input has keys
+ * in their key range. This avoids reconstructing and repacking the objects of the blocks,
+ * which makes merging a small delta into a large store much cheaper. See BlockCopier.
+ * Returns the number of copied blocks. The output has a different layout than the one of merge().
+ */
+inline size_t mergeCopyingBlocks(std::vector<std::string> &inputFiles, std::string &outputFile,
+                                 int openFlags = O_DIRECT, size_t indexBinsPerBlock = 0,
+                                 size_t readBufferBytes = MERGE_DEFAULT_READ_BUFFER,
+                                 MergeMode mode = MergeMode::DISJOINT,
+                                 size_t minCopyBlocks = MERGE_DEFAULT_MIN_COPY_BLOCKS) {
+    size_t readAheadBlocks = mergeReadAheadBlocks(inputFiles.size(), readBufferBytes);
+    size_t totalBlocks = 0;
+    for (const std::string& inputFile : inputFiles) {
+        totalBlocks += VariableSizeObjectStore::readMetadata(inputFile.c_str()).numBlocks;
+    }
 
-        minReader.next();
-        if (minReader.hasEnded()) {
-            readersCompleted++;
-            minReader.completed = true;
-        }
+    LinearObjectWriter writer(outputFile.c_str(), openFlags);
+    if (indexBinsPerBlock > 0) {
+        writer.enableIndexFooter(indexBinsPerBlock);
+    }
+    BlockCopier blockCopier(writer, minCopyBlocks, mode == MergeMode::NEWEST_WINS);
+    std::vector<size_t> firstBlocks(inputFiles.size(), 0);
+    mergeKeyRange<true>(inputFiles, firstBlocks, openFlags, readAheadBlocks, 1, ~StoreConfig::key_t(0), mode,
+                        [&](LinearObjectReader<true> &reader) {
+        writer.write(reader.currentKey, reader.currentLength, reader.currentElementPointer);
         LOG("Merging", writer.blocksGenerated - 1, totalBlocks);
+    }, std::ref(blockCopier));
+
+    writer.close(VariableSizeObjectStore::StoreMetadata::TYPE_PACHASH);
+    return blockCopier.copiedBlocks;
+}
+
+/**
+ * Merge PaCHash files into a single one. With indexBinsPerBlock > 0, the output gets an IndexFooter.
+ * The input readers share a read-ahead buffer of about readBufferBytes.
+ * With multiple threads, disjoint key ranges are merged in parallel, see mergeParallel().
+ * See MergeMode for keys that occur in multiple inputs.
+ * If given, the keyObserver is called with the key of each object that is written to the output.
+ */
+inline void merge(std::vector<std::string> &inputFiles, std::string &outputFile, int openFlags = O_DIRECT,
+                  size_t indexBinsPerBlock = 0, size_t readBufferBytes = MERGE_DEFAULT_READ_BUFFER,
+                  size_t numThreads = 1, MergeMode mode = MergeMode::DISJOINT,
+                  const std::function<void(StoreConfig::key_t)> &keyObserver = nullptr) {
+    if (numThreads > 1) {
+        mergeParallel(inputFiles, outputFile, openFlags, indexBinsPerBlock, readBufferBytes, numThreads, mode,
+                      keyObserver);
+        return;
+    }
+    size_t readAheadBlocks = mergeReadAheadBlocks(inputFiles.size(), readBufferBytes);
+    size_t totalBlocks = 0;
+    for (const std::string& inputFile : inputFiles) {
+        totalBlocks += VariableSizeObjectStore::readMetadata(inputFile.c_str()).numBlocks;
     }
 
+    LinearObjectWriter writer(outputFile.c_str(), openFlags);
+    if (indexBinsPerBlock > 0) {
+        writer.enableIndexFooter(indexBinsPerBlock);
+    }
+    std::vector<size_t> firstBlocks(inputFiles.size(), 0);
+    mergeKeyRange<true>(inputFiles, firstBlocks, openFlags, readAheadBlocks, 1, ~StoreConfig::key_t(0), mode,
+                        [&](LinearObjectReader<true> &reader) {
+        writer.write(reader.currentKey, reader.currentLength, reader.currentElementPointer);
+        if (keyObserver) {
+            keyObserver(reader.currentKey);
+        }
+        LOG("Merging", writer.blocksGenerated - 1, totalBlocks);
+    });
+
     writer.close(VariableSizeObjectStore::StoreMetadata::TYPE_PACHASH);
 }
+
+/**
+ * Split a PaCHash file into one file per output by key range. Output i gets the keys in
+ * [i * 2^64 / n, (i + 1) * 2^64 / n), where n is the number of outputs. Each output is a complete PaCHash file,
+ * with an IndexFooter if indexBinsPerBlock > 0.
+ * The outputs are written by numThreads threads, whose readers share a read-ahead buffer of about readBufferBytes.
+ * The start of each key range is found with findFirstBlockOfKeyRange(), and runs of whole blocks within a range
+ * are copied without repacking their objects, see BlockCopier.
+ * If writing an output fails, the remaining outputs are skipped and the error is rethrown.
+ */
+inline void split(const std::string &inputFile, std::vector<std::string> &outputFiles, int openFlags = O_DIRECT,
+                  size_t indexBinsPerBlock = 0, size_t readBufferBytes = MERGE_DEFAULT_READ_BUFFER,
+                  size_t numThreads = 1, size_t minCopyBlocks = MERGE_DEFAULT_MIN_COPY_BLOCKS) {
+    size_t numOutputs = outputFiles.size();
+    if (numOutputs == 0) {
+        throw std::invalid_argument("Need at least one output file");
+    }
+    size_t inputBlocks = VariableSizeObjectStore::readMetadata(inputFile.c_str()).numBlocks;
+    numThreads = std::max(1ul, std::min(numThreads, numOutputs));
+    size_t readAheadBlocks = mergeReadAheadBlocks(numThreads, readBufferBytes);
+    std::vector<std::string> inputFiles = {inputFile};
+
+    LOG("Splitting");
+    std::atomic<size_t> nextOutput = 0;
+    BlockRanges(numOutputs, numThreads, 1).inParallel([&](size_t) {
+        for (size_t output = nextOutput++; output < numOutputs; output = nextOutput++) {
+            try {
+                StoreConfig::key_t rangeSize = ~StoreConfig::key_t(0) / numOutputs;
+                StoreConfig::key_t firstKey = output == 0 ? 1 : rangeSize * output; // Key 0 holds metadata
+                StoreConfig::key_t lastKey = output == numOutputs - 1 ? ~StoreConfig::key_t(0)
+                        : rangeSize * (output + 1) - 1;
+                std::vector<size_t> firstBlocks = {output == 0 ? 0
+                        : findFirstBlockOfKeyRange(inputFile.c_str(), openFlags, inputBlocks, firstKey)};
+                LinearObjectWriter writer(outputFiles[output].c_str(), openFlags);
+                if (indexBinsPerBlock > 0) {
+                    writer.enableIndexFooter(indexBinsPerBlock);
+                }
+                BlockCopier blockCopier(writer, minCopyBlocks, false);
+                mergeKeyRange<true>(inputFiles, firstBlocks, openFlags, readAheadBlocks, firstKey, lastKey,
+                                    MergeMode::DISJOINT, [&](LinearObjectReader<true> &reader) {
+                    writer.write(reader.currentKey, reader.currentLength, reader.currentElementPointer);
+                }, std::ref(blockCopier));
+                writer.close(VariableSizeObjectStore::StoreMetadata::TYPE_PACHASH);
+            } catch (...) {
+                nextOutput = numOutputs; // Other threads stop after their current output
+                throw;
+            }
+        }
+    });
+    LOG(nullptr);
+}
 } // Namespace pachash
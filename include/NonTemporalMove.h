@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace pachash {
+/**
+ * Like memmove, but writes the destination with non-temporal stores that bypass the cache.
+ * Moving large objects then does not evict the rest of the working set, and the destination is not read first.
+ * Overlapping ranges are only supported if the destination is in front of the source,
+ * which is the case when moving object parts over the block tables in a query buffer.
+ */
+inline void moveNonTemporal(char *destination, const char *source, size_t length) {
+    #if defined(__SSE2__)
+        constexpr size_t VECTOR = sizeof(__m128i);
+        assert(destination <= source || destination >= source + length);
+        size_t head = (VECTOR - reinterpret_cast<uintptr_t>(destination) % VECTOR) % VECTOR;
+        if (length < head + 4 * VECTOR) {
+            memmove(destination, source, length);
+            return;
+        }
+        memmove(destination, source, head);
+        destination += head;
+        source += head;
+        length -= head;
+        for (; length >= 4 * VECTOR; length -= 4 * VECTOR) {
+            // All four vectors are loaded before storing, so the stores never overwrite unread source bytes
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + VECTOR));
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 2 * VECTOR));
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + 3 * VECTOR));
+            _mm_stream_si128(reinterpret_cast<__m128i *>(destination), a);
+            _mm_stream_si128(reinterpret_cast<__m128i *>(destination + VECTOR), b);
+            _mm_stream_si128(reinterpret_cast<__m128i *>(destination + 2 * VECTOR), c);
+            _mm_stream_si128(reinterpret_cast<__m128i *>(destination + 3 * VECTOR), d);
+            destination += 4 * VECTOR;
+            source += 4 * VECTOR;
+        }
+        memmove(destination, source, length);
+        _mm_sfence();
+    #else
+        memmove(destination, source, length);
+    #endif
+}
+} // Namespace pachash
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdexcept>
 #include "QueryHandle.h"
 
 namespace pachash {
@@ -19,9 +20,37 @@ class ObjectStoreView {
         }
 
         inline void enqueueQuery(QueryHandle *handle) {
+            if (handle->buffer == nullptr && handle->bufferPool == nullptr) {
+                throw std::logic_error("Handle without buffer or buffer pool needs a destination");
+            }
+            handle->destination = nullptr;
             objectStore->enqueueQuery(handle, &ioManager);
         }
 
+        /**
+         * Like enqueueQuery(handle), but reads into the given memory instead of the buffer of the handle.
+         * Objects are reconstructed in place there, so after completion, resultPtr points into the destination
+         * and no further copy is needed. The destination must stay valid until the query completes.
+         * It must be aligned to the block length, which is what the IO managers need for O_DIRECT.
+         * It needs at least requiredBufferForKey(key) bytes, which is checked when enqueueing.
+         * Throws std::invalid_argument without enqueueing the query if one of the requirements is not met.
+         */
+        inline void enqueueQuery(QueryHandle *handle, char *destination, size_t destinationSize) {
+            if (reinterpret_cast<uintptr_t>(destination) % StoreConfig::BLOCK_LENGTH != 0) {
+                throw std::invalid_argument("Destination needs to be aligned to the block length");
+            }
+            handle->destination = destination;
+            handle->destinationSize = destinationSize;
+            objectStore->enqueueQuery(handle, &ioManager);
+        }
+
+        /**
+         * Size of the destination that a query for the key needs, see enqueueQuery(handle, destination, size).
+         */
+        inline size_t requiredBufferForKey(StoreConfig::key_t key) {
+            return objectStore->requiredBufferForKey(key);
+        }
+
         inline QueryHandle *awaitAny() {
             return objectStore->awaitAny(&ioManager);
         }
@@ -31,7 +60,12 @@ class ObjectStoreView {
         }
 
         inline void submitQuery(QueryHandle *handle) {
-            objectStore->enqueueQuery(handle, &ioManager);
+            enqueueQuery(handle);
+            ioManager.submit();
+        }
+
+        inline void submitQuery(QueryHandle *handle, char *destination, size_t destinationSize) {
+            enqueueQuery(handle, destination, destinationSize);
             ioManager.submit();
         }
 
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include "VariableSizeObjectStore.h"
+#include "LinearObjectWriter.h"
+#include "ValueSink.h"
+
+namespace pachash {
+/**
+ * Writes a PaCHash file from a stream of objects that is already sorted by (hashed) key,
+ * for example the output of another store, a merge, or an external sorter.
+ * In contrast to PaCHashObjectStore::writeToFile, the input is never sorted and does not need to be in memory.
+ * Objects are written directly to the block buffers, so the memory usage is LinearObjectWriter::MEMORY_USAGE.
+ * The resulting file can be opened with PaCHashObjectStore.
+ */
+class PaCHashBuilder {
+    private:
+        /**
+         * Forwards to the sink of the writer, but rejects pieces beyond the declared length.
+         */
+        class LengthCheckingSink : public ValueSink {
+            private:
+                ValueSink &sink;
+            public:
+                size_t bytesLeft;
+
+                LengthCheckingSink(ValueSink &sink, size_t length) : sink(sink), bytesLeft(length) {
+                }
+
+                void append(const char *data, size_t length) final {
+                    if (length > bytesLeft) {
+                        throw std::invalid_argument("Value producer appended more than the declared length");
+                    }
+                    bytesLeft -= length;
+                    sink.append(data, length);
+                }
+        };
+
+        LinearObjectWriter writer;
+        StoreConfig::key_t previousKey = 0;
+        bool finished = false;
+        bool failed = false;
+    public:
+        size_t numObjects = 0;
+        size_t totalPayloadSize = 0;
+
+        /**
+         * @param indexBinsPerBlock Parameter a of the PaCHashObjectStore that will open the file.
+         *          Stores an IndexFooter for it, so that it does not need to scan the file. 0 to disable.
+         * @param blockSlack See PaCHashObjectStore::blockSlack.
+         */
+        PaCHashBuilder(const char *filename, int openFlags, size_t indexBinsPerBlock = 0, size_t blockSlack = 0)
+                : writer(filename, openFlags) {
+            if (indexBinsPerBlock > 0) {
+                writer.enableIndexFooter(indexBinsPerBlock);
+            }
+            writer.enableBlockSlack(blockSlack);
+        }
+
+        /**
+         * Append an object. Keys must be strictly increasing and must not be 0.
+         */
+        void append(StoreConfig::key_t key, size_t length, const char *content) {
+            checkKey(key);
+            writer.write(key, length, content);
+            notifyAppended(key, length);
+        }
+
+        /**
+         * Append an object whose content is appended to a sink by calling producer(sink). See ValueSink.
+         * Throws if the producer does not append exactly the given length. The builder cannot be used after that.
+         */
+        template <typename ValueProducer>
+        requires std::is_invocable_v<ValueProducer, ValueSink &>
+        void append(StoreConfig::key_t key, size_t length, ValueProducer producer) {
+            checkKey(key);
+            failed = true; // Until the object is complete
+            writer.write(key, length, [&](ValueSink &sink) {
+                LengthCheckingSink checkingSink(sink, length);
+                producer(checkingSink);
+                if (checkingSink.bytesLeft != 0) {
+                    throw std::invalid_argument("Value producer appended "
+                            + std::to_string(length - checkingSink.bytesLeft)
+                            + " bytes instead of the declared " + std::to_string(length));
+                }
+            });
+            failed = false;
+            notifyAppended(key, length);
+        }
+
+        /**
+         * Write the last block, the index footer and the metadata.
+         */
+        void finish() {
+            if (failed) {
+                throw std::logic_error("PaCHashBuilder failed on a previous object");
+            }
+            if (finished) {
+                throw std::logic_error("PaCHashBuilder already finished");
+            }
+            finished = true;
+            writer.close(VariableSizeObjectStore::StoreMetadata::TYPE_PACHASH);
+        }
+
+    private:
+        void checkKey(StoreConfig::key_t key) const {
+            if (failed) {
+                throw std::logic_error("PaCHashBuilder failed on a previous object");
+            }
+            if (finished) {
+                throw std::logic_error("Appending to a finished PaCHashBuilder");
+            }
+            if (key == 0) {
+                throw std::invalid_argument("Key 0 is reserved for metadata");
+            }
+            if (numObjects > 0 && key <= previousKey) {
+                throw std::invalid_argument("Keys must be strictly increasing, got " + std::to_string(key)
+                        + " after " + std::to_string(previousKey));
+            }
+        }
+
+        void notifyAppended(StoreConfig::key_t key, size_t length) {
+            previousKey = key;
+            numObjects++;
+            totalPayloadSize += length;
+        }
+};
+} // Namespace pachash
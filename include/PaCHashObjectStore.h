@@ -10,9 +10,14 @@
 #include <bytehamster/util/Files.h>
 #include "IoManager.h"
 #include "VariableSizeObjectStore.h"
+#include "IndexFooter.h"
 #include "LinearObjectWriter.h"
+#include "ParallelSort.h"
+#include "InputPrefetcher.h"
 #include "BlockIterator.h"
 #include "PaCHashIndex.h"
+#include "KeySearch.h"
+#include "NonTemporalMove.h"
 
 namespace pachash {
 /**
@@ -25,6 +30,12 @@ class PaCHashObjectStore : public VariableSizeObjectStore {
         using Super = VariableSizeObjectStore;
         Index *index = nullptr;
         size_t numBins = 0;
+        // Bytes left empty at the end of each block during construction, so that objects can grow
+        // in updateInPlace(). Up to LinearObjectWriter::MAX_BLOCK_SLACK.
+        size_t blockSlack = 0;
+    private:
+        int updateFd = -1;
+    public:
 
         explicit PaCHashObjectStore([[maybe_unused]] float loadFactor, const char* filename, int openFlags)
                 : VariableSizeObjectStore(1.0f, filename, openFlags) {
@@ -33,6 +44,9 @@ class PaCHashObjectStore : public VariableSizeObjectStore {
 
         ~PaCHashObjectStore() override {
             delete index;
+            if (updateFd >= 0) {
+                close(updateFd);
+            }
         }
 
         static std::string name() {
@@ -40,23 +54,58 @@ class PaCHashObjectStore : public VariableSizeObjectStore {
         }
 
         size_t key2bin(StoreConfig::key_t key) {
-            #ifdef __SIZEOF_INT128__ // fastrange64
-                static_assert(sizeof(key) == sizeof(uint64_t));
-                return (uint64_t)(((__uint128_t)key * (__uint128_t)numBins) >> 64);
-            #else
-                return key / (~size_t(0)/numBins);
-            #endif
+            return IndexFooter::key2bin(key, numBins);
         }
 
+        /**
+         * Sorts the input by key and writes it to the file.
+         * Instead of a value pointer extractor, a value producer can be passed. See ValueSink.
+         * When using multiple threads, the extractor functions are called concurrently and must be thread-safe.
+         * The resulting file is the same for every number of threads, as long as the keys are unique.
+         * The sort is not stable, so the order of objects with the same key can depend on the number of threads.
+         */
         template <class Iterator, typename HashFunction, typename LengthExtractor, typename ValuePointerExtractor,
                 class U = typename std::iterator_traits<Iterator>::value_type>
         void writeToFile(Iterator begin, Iterator end, HashFunction hashFunction,
-                         LengthExtractor lengthExtractor, ValuePointerExtractor valuePointerExtractor) {
+                         LengthExtractor lengthExtractor, ValuePointerExtractor valuePointerExtractor,
+                         size_t numThreads = 1) {
+            writeToFile(begin, end, hashFunction, lengthExtractor, valuePointerExtractor, NoPrefetch(), numThreads);
+        }
+
+        /**
+         * Like writeToFile, but prefetches the input of upcoming objects while writing.
+         * The prefetch extractor returns the memory range (std::span<const char>) that the value extractor
+         * reads for an object. This helps when the values are located in a memory-mapped file. See InputPrefetcher.
+         */
+        template <class Iterator, typename HashFunction, typename LengthExtractor, typename ValuePointerExtractor,
+                typename PrefetchExtractor, class U = typename std::iterator_traits<Iterator>::value_type>
+        requires std::is_invocable_r_v<std::span<const char>, PrefetchExtractor, U>
+        void writeToFile(Iterator begin, Iterator end, HashFunction hashFunction,
+                         LengthExtractor lengthExtractor, ValuePointerExtractor valuePointerExtractor,
+                         PrefetchExtractor prefetchExtractor, size_t numThreads = 1) {
             static_assert(std::is_invocable_r_v<StoreConfig::key_t, HashFunction, U>);
             static_assert(std::is_invocable_r_v<size_t, LengthExtractor, U>);
-            static_assert(std::is_invocable_r_v<const char *, ValuePointerExtractor, U>);
-
+            static_assert(isValueExtractor<ValuePointerExtractor, U>);
             constructionTimer.notifyStartConstruction();
+            writeToFileAfterStart(begin, end, hashFunction, lengthExtractor, valuePointerExtractor,
+                                  prefetchExtractor, numThreads);
+        }
+
+    private:
+        /**
+         * Body of writeToFile, after the construction timer was started.
+         */
+        template <class Iterator, typename HashFunction, typename LengthExtractor, typename ValuePointerExtractor,
+                typename PrefetchExtractor>
+        void writeToFileAfterStart(Iterator begin, Iterator end, HashFunction hashFunction,
+                                   LengthExtractor lengthExtractor, ValuePointerExtractor valuePointerExtractor,
+                                   PrefetchExtractor prefetchExtractor, size_t numThreads) {
+            if (numThreads > 1) {
+                writeToFileParallel(begin, end, hashFunction, lengthExtractor, valuePointerExtractor,
+                                    prefetchExtractor, numThreads);
+                return;
+            }
+
             constructionTimer.notifyDeterminedSpace();
             numObjects = end - begin;
             LOG("Sorting input keys");
@@ -65,23 +114,77 @@ class PaCHashObjectStore : public VariableSizeObjectStore {
             constructionTimer.notifyPlacedObjects();
 
             LOG("Writing");
-            LinearObjectWriter writer(filename, openFlags);
+            LinearObjectWriter writer(filename, openFlags, 0, ~0ul, writeQueueDepth);
+            writer.enableIndexFooter(a);
+            writer.enableBlockSlack(blockSlack);
+            InputPrefetcher prefetcher(begin, 0, numObjects, prefetchExtractor);
             Iterator it = begin;
             for (size_t i = 0; i < numObjects; i++) {
+                prefetcher.beforeAccess(i);
                 StoreConfig::key_t key = hashFunction(*it);
                 assert(key != 0); // Key 0 holds metadata
                 size_t length = lengthExtractor(*it);
                 totalPayloadSize += length;
-                const char *content = valuePointerExtractor(*it);
-                writer.write(key, length, content);
+                writer.write(key, length, valueSource(valuePointerExtractor, *it));
                 LOG("Writing", i, numObjects);
                 it++;
             }
             writer.close(StoreMetadata::TYPE_PACHASH);
+            constructionTimer.notifyWriteStall(writer.writeStallNanoseconds());
+            buildIndexAfterWriting(writer.indexFooterRecorder(), writer.blocksGenerated, writer.maxObjectSize());
             constructionTimer.notifyWroteObjects();
         }
 
-        void writeToFile(std::vector<std::pair<std::string, std::string>> &vector) {
+    public:
+        /**
+         * Like writeToFile, but calls the hash function only once per object.
+         * Instead of the input objects, only compact (key, index) records are sorted.
+         * This is faster for objects that are expensive to hash or to move. The input is not reordered.
+         */
+        template <class Iterator, typename HashFunction, typename LengthExtractor, typename ValuePointerExtractor,
+                class U = typename std::iterator_traits<Iterator>::value_type>
+        void writeToFileHashOnce(Iterator begin, Iterator end, HashFunction hashFunction,
+                                 LengthExtractor lengthExtractor, ValuePointerExtractor valuePointerExtractor,
+                                 size_t numThreads = 1) {
+            static_assert(std::is_invocable_r_v<StoreConfig::key_t, HashFunction, U>);
+            static_assert(std::is_invocable_r_v<size_t, LengthExtractor, U>);
+            static_assert(isValueExtractor<ValuePointerExtractor, U>);
+            struct ProxyRecord {
+                StoreConfig::key_t key;
+                size_t index;
+            };
+            constructionTimer.notifyStartConstruction();
+            size_t n = end - begin;
+            LOG("Hashing input keys");
+            std::vector<ProxyRecord> proxies(n);
+            BlockRanges ranges(n, numThreads, 1);
+            ranges.inParallel([&](size_t thread) {
+                for (size_t i = ranges.firstBlock(thread); i < ranges.endBlock(thread); i++) {
+                    proxies[i] = ProxyRecord{hashFunction(begin[i]), i};
+                }
+            });
+            auto proxyKey = [](const ProxyRecord &proxy) -> StoreConfig::key_t {
+                return proxy.key;
+            };
+            auto proxyLength = [&](const ProxyRecord &proxy) -> size_t {
+                return lengthExtractor(begin[proxy.index]);
+            };
+            if constexpr (isValueProducer<ValuePointerExtractor, U>) {
+                auto proxyValue = [&](const ProxyRecord &proxy, ValueSink &sink) {
+                    valuePointerExtractor(begin[proxy.index], sink);
+                };
+                writeToFileAfterStart(proxies.begin(), proxies.end(), proxyKey, proxyLength, proxyValue, NoPrefetch(),
+                                      numThreads);
+            } else {
+                auto proxyValue = [&](const ProxyRecord &proxy) -> const char * {
+                    return valuePointerExtractor(begin[proxy.index]);
+                };
+                writeToFileAfterStart(proxies.begin(), proxies.end(), proxyKey, proxyLength, proxyValue, NoPrefetch(),
+                                      numThreads);
+            }
+        }
+
+        void writeToFile(std::vector<std::pair<std::string, std::string>> &vector, size_t numThreads = 1) {
             auto hashFunction = [](const std::pair<std::string, std::string> &x) -> StoreConfig::key_t {
                 return bytehamster::util::MurmurHash64(std::get<0>(x).data(), std::get<0>(x).length());
             };
@@ -91,11 +194,16 @@ class PaCHashObjectStore : public VariableSizeObjectStore {
             auto valueEx = [](const std::pair<std::string, std::string> &x) -> const char * {
                 return std::get<1>(x).data();
             };
-            writeToFile(vector.begin(), vector.end(), hashFunction, lengthEx, valueEx);
+            writeToFileHashOnce(vector.begin(), vector.end(), hashFunction, lengthEx, valueEx, numThreads);
         }
 
-        void buildIndex() final {
+        void buildIndex(size_t numThreads = 1) final {
             constructionTimer.notifySyncedFile();
+            if (index != nullptr) {
+                // Already built by writeToFile
+                constructionTimer.notifyReadComplete();
+                return;
+            }
             StoreMetadata metadata = readMetadata(filename);
             if (metadata.type != StoreMetadata::TYPE_PACHASH) {
                 throw std::logic_error("Opened file of wrong type");
@@ -104,46 +212,18 @@ class PaCHashObjectStore : public VariableSizeObjectStore {
             maxSize = metadata.maxSize;
             numBins = numBlocks * a;
 
-            #ifdef HAS_LIBURING
-            UringDoubleBufferBlockIterator blockIterator(filename, numBlocks, 2500, openFlags);
-            #else
-            PosixBlockIterator blockIterator(filename, numBlocks, openFlags);
-            #endif
             index = new Index(numBlocks, numBins);
-            size_t keysRead = 0;
-            StoreConfig::key_t lastKeyInPreviousBlock = 0;
-            for (size_t blocksRead = 0; blocksRead < numBlocks; blocksRead++) {
-                BlockStorage block(blockIterator.blockContent());
-
-                size_t lastBinInPreviousBlock = key2bin(lastKeyInPreviousBlock);
-                if (block.numObjects > 0 && block.offsets[0] == 0) {
-                    size_t firstBinInThisBlock = key2bin(block.keys[0]);
-                    if (firstBinInThisBlock - lastBinInPreviousBlock >= 1) {
-                        // Empty bin between both blocks. Optimization: Account the empty bin to the current block,
-                        // so that when reading the first full bin of the current block or the last full bin
-                        // of the previous block, we do not need to load the other block unnecessarily.
-                        index->push_back(firstBinInThisBlock - 1);
-                    } else {
-                        index->push_back(lastBinInPreviousBlock);
-                    }
-                } else {
-                    index->push_back(lastBinInPreviousBlock);
-                }
-                if (block.numObjects > 0) {
-                    StoreConfig::key_t key = block.keys[block.numObjects - 1];
-                    // Last block can contain 0 again as a terminator for the last object
-                    assert(key > lastKeyInPreviousBlock || blocksRead == numBlocks - 1);
-                    lastKeyInPreviousBlock = key;
-                }
-                keysRead += block.numObjects;
-                if (blocksRead < numBlocks - 1) {
-                    blockIterator.next(); // Don't try to read more than the last one
-                }
-                LOG("Reading", blocksRead, numBlocks);
+            if (metadata.indexSize > 0 && metadata.indexBinsPerBlock == a) {
+                LOG("Loading index");
+                std::vector<uint64_t> footer = IndexFooter::read(filename, metadata.indexOffset, metadata.indexSize);
+                numObjects = IndexFooter::decode(footer, numBlocks, a, [&](size_t bin) {
+                    index->push_back(bin);
+                });
+                LOG(nullptr);
+            } else {
+                // Files written by older versions or with a different parameter a
+                scanBlocks(numThreads);
             }
-            LOG(nullptr);
-            numObjects = keysRead;
-
             index->complete();
             constructionTimer.notifyReadComplete();
         }
@@ -166,6 +246,12 @@ class PaCHashObjectStore : public VariableSizeObjectStore {
             return 1;
         }
 
+        size_t requiredBufferForKey(StoreConfig::key_t key) override {
+            std::tuple<size_t, size_t> accessDetails;
+            index->locate(key2bin(key), accessDetails);
+            return std::get<1>(accessDetails) * StoreConfig::BLOCK_LENGTH;
+        }
+
         template <typename IoManager>
         void enqueueQuery(QueryHandle *handle, IoManager ioManager) {
             assert(handle->state == 0 && "Used handle that did not go through awaitCompletion()");
@@ -182,7 +268,8 @@ class PaCHashObjectStore : public VariableSizeObjectStore {
 
             // Using the resultPointers as a temporary store.
             handle->length = blocksAccessed;
-            ioManager->enqueueRead(handle->buffer, blockStartPosition, searchRangeLength,
+            handle->acquireBuffer(searchRangeLength);
+            ioManager->enqueueRead(handle->readBuffer(), blockStartPosition, searchRangeLength,
                                    reinterpret_cast<uint64_t>(handle));
         }
 
@@ -202,7 +289,320 @@ class PaCHashObjectStore : public VariableSizeObjectStore {
             return handle;
         }
 
+        /**
+         * Replace the value of an existing object by rewriting the blocks that contain it.
+         * The size difference is absorbed by the empty space at the end of the block that holds the last
+         * piece of the object. No object moves to a different block, so the index and footer stay valid
+         * and queries still need a single I/O. Set blockSlack before writing to leave room for growing objects.
+         * Returns false without modifying the file if the key is not contained, if the value is larger than
+         * the largest object of the file, or if the size difference does not fit into the empty space.
+         * Such updates need to rebuild the file, for example with merge().
+         * Not safe to call concurrently with other updates or with queries.
+         */
+        bool updateInPlace(StoreConfig::key_t key, const char *value, size_t length) {
+            if (key == 0 || length > maxSize) {
+                return false;
+            }
+            if (updateFd < 0) {
+                updateFd = open(filename, O_RDWR | openFlags);
+                if (updateFd < 0) {
+                    throw std::ios_base::failure("Unable to open " + std::string(filename)
+                             + ": " + std::string(strerror(errno)));
+                }
+            }
+            std::tuple<size_t, size_t> accessDetails;
+            index->locate(key2bin(key), accessDetails);
+            size_t firstBlock = std::get<0>(accessDetails);
+            // The object starts in the search range. Blocks in the middle of an object always hold at least
+            // BLOCK_LENGTH - overheadPerBlock - 255 bytes of it, which bounds the number of blocks it spans.
+            size_t maxBlocksSpanned = maxSize / (StoreConfig::BLOCK_LENGTH - overheadPerBlock - UINT8_MAX) + 2;
+            size_t blocksRead = std::min(numBlocks - firstBlock, std::get<1>(accessDetails) + maxBlocksSpanned);
+            char *buffer = new (std::align_val_t(StoreConfig::BLOCK_LENGTH)) char[blocksRead * StoreConfig::BLOCK_LENGTH];
+            ssize_t result = pread(updateFd, buffer, blocksRead * StoreConfig::BLOCK_LENGTH,
+                                   firstBlock * StoreConfig::BLOCK_LENGTH);
+            if (result != ssize_t(blocksRead * StoreConfig::BLOCK_LENGTH)) {
+                operator delete[](buffer, std::align_val_t(StoreConfig::BLOCK_LENGTH));
+                throw std::ios_base::failure("Unable to read " + std::string(filename));
+            }
+            std::pair<size_t, size_t> modifiedBlocks;
+            bool updated = rewriteObject(buffer, firstBlock, std::min(blocksRead, std::get<1>(accessDetails)), blocksRead,
+                                         key, value, length, modifiedBlocks);
+            if (updated) {
+                size_t writeLength = (modifiedBlocks.second - modifiedBlocks.first) * StoreConfig::BLOCK_LENGTH;
+                result = pwrite(updateFd, buffer + modifiedBlocks.first * StoreConfig::BLOCK_LENGTH, writeLength,
+                                (firstBlock + modifiedBlocks.first) * StoreConfig::BLOCK_LENGTH);
+                if (result != ssize_t(writeLength)) {
+                    operator delete[](buffer, std::align_val_t(StoreConfig::BLOCK_LENGTH));
+                    throw std::ios_base::failure("Unable to write " + std::string(filename));
+                }
+            }
+            operator delete[](buffer, std::align_val_t(StoreConfig::BLOCK_LENGTH));
+            return updated;
+        }
+
     private:
+        /**
+         * Rewrite the object in the given blocks, which start at firstBlock in the file.
+         * The object starts in one of the first searchBlocks blocks.
+         * Sets modifiedBlocks to the (begin, end) range of blocks in the buffer that need to be written back.
+         */
+        bool rewriteObject(char *buffer, size_t firstBlock, size_t searchBlocks, size_t blocksRead, StoreConfig::key_t key,
+                           const char *value, size_t length, std::pair<size_t, size_t> &modifiedBlocks) {
+            struct Piece {
+                size_t block;
+                size_t begin;
+                size_t end;
+            };
+            auto dataEnd = [](BlockStorage &block) -> size_t {
+                return block.tableStart - block.blockStart - block.emptyPageEnd;
+            };
+            std::vector<Piece> pieces;
+            size_t entryOnLastPiece = 0; // Table entries from this index on start behind the last piece
+            for (size_t blockIdx = 0; blockIdx < searchBlocks && pieces.empty(); blockIdx++) {
+                BlockStorage block(buffer + blockIdx * StoreConfig::BLOCK_LENGTH);
+                for (size_t i = 0; i < block.numObjects; i++) {
+                    if (block.keys[i] != key) {
+                        continue;
+                    }
+                    if (i + 1 < block.numObjects) {
+                        pieces.push_back({blockIdx, block.offsets[i], block.offsets[i + 1]});
+                        entryOnLastPiece = i + 1;
+                        break;
+                    }
+                    // Last object on the block, continues up to the first table entry of a following block
+                    pieces.push_back({blockIdx, block.offsets[i], dataEnd(block)});
+                    size_t nextIdx = blockIdx + 1;
+                    for (; nextIdx < blocksRead; nextIdx++) {
+                        BlockStorage nextBlock(buffer + nextIdx * StoreConfig::BLOCK_LENGTH);
+                        if (nextBlock.numObjects > 0) {
+                            if (nextBlock.offsets[0] > 0) {
+                                pieces.push_back({nextIdx, 0, nextBlock.offsets[0]});
+                            }
+                            // Otherwise, the object must not grow into the next block. Queries for its bin
+                            // do not necessarily load that block.
+                            break;
+                        }
+                        pieces.push_back({nextIdx, 0, dataEnd(nextBlock)});
+                    }
+                    if (nextIdx == blocksRead && firstBlock + blocksRead < numBlocks) {
+                        return false; // Object not completely loaded
+                    }
+                    entryOnLastPiece = pieces.size() == 1 ? i + 1 : 0;
+                    break;
+                }
+            }
+            if (pieces.empty()) {
+                return false;
+            }
+
+            size_t oldLength = 0;
+            for (Piece &piece : pieces) {
+                oldLength += piece.end - piece.begin;
+            }
+            Piece &last = pieces.back();
+            size_t lengthBeforeLast = oldLength - (last.end - last.begin);
+            if (length < lengthBeforeLast) {
+                return false; // Would need to remove blocks
+            }
+            long sizeChange = long(length) - long(oldLength);
+            BlockStorage lastBlock(buffer + last.block * StoreConfig::BLOCK_LENGTH);
+            long newEmptyPageEnd = long(lastBlock.emptyPageEnd) - sizeChange;
+            if (newEmptyPageEnd < 0 || newEmptyPageEnd > UINT8_MAX) {
+                return false;
+            }
+
+            // Move the data behind the object and adjust the table of the block that holds its last piece
+            size_t oldDataEnd = dataEnd(lastBlock);
+            memmove(lastBlock.blockStart + last.end + sizeChange, lastBlock.blockStart + last.end,
+                    oldDataEnd - last.end);
+            if (sizeChange < 0) {
+                memset(lastBlock.blockStart + oldDataEnd + sizeChange, 0, -sizeChange);
+            }
+            for (size_t i = entryOnLastPiece; i < lastBlock.numObjects; i++) {
+                lastBlock.offsets[i] += sizeChange;
+            }
+            lastBlock.blockStart[StoreConfig::BLOCK_LENGTH - overheadPerBlock] = char(newEmptyPageEnd);
+            last.end += sizeChange;
+
+            for (Piece &piece : pieces) {
+                memcpy(buffer + piece.block * StoreConfig::BLOCK_LENGTH + piece.begin, value, piece.end - piece.begin);
+                value += piece.end - piece.begin;
+            }
+            modifiedBlocks = {pieces.front().block, last.block + 1};
+            return true;
+        }
+
+        void buildIndexAfterWriting(const IndexFooter::Recorder &recorder, size_t blocks, size_t maxObjectSize) {
+            LOG("Building index");
+            numBlocks = blocks;
+            maxSize = maxObjectSize;
+            numBins = numBlocks * a;
+            delete index;
+            index = new Index(numBlocks, numBins);
+            recorder.forEachBin(numBlocks, a, [&](size_t bin) {
+                index->push_back(bin);
+            });
+            index->complete();
+            LOG(nullptr);
+        }
+
+        /**
+         * Each thread scans a range of blocks. The first bins of a range depend on the last key before the range,
+         * so threads calculate them as if that key was 0. When concatenating the ranges, the bins are corrected
+         * by taking the maximum with the bin of the actual last key before the range.
+         */
+        void scanBlocks(size_t numThreads) {
+            numThreads = std::max(1ul, std::min(numThreads, numBlocks / 2500));
+            std::vector<std::vector<size_t>> binsOfRange(numThreads);
+            std::vector<StoreConfig::key_t> lastKeyOfRange(numThreads, 0);
+            std::vector<size_t> keysReadOfRange(numThreads, 0);
+            forEachBlockRangeParallel(numBlocks, numThreads, 1, [&](size_t thread, size_t firstBlock, size_t endBlock) {
+                std::vector<size_t> &bins = binsOfRange[thread];
+                bins.reserve(endBlock - firstBlock);
+                StoreConfig::key_t lastKeyInPreviousBlock = 0;
+                forEachBlock(filename, firstBlock, endBlock, openFlags, [&](size_t blockIdx, char *content) {
+                    BlockStorage block(content);
+                    size_t lastBinInPreviousBlock = key2bin(lastKeyInPreviousBlock);
+                    if (block.numObjects > 0 && block.offsets[0] == 0 && block.keys[0] != 0) {
+                        size_t firstBinInThisBlock = key2bin(block.keys[0]);
+                        if (firstBinInThisBlock - lastBinInPreviousBlock >= 1) {
+                            // Empty bin between both blocks. Optimization: Account the empty bin to the current block,
+                            // so that when reading the first full bin of the current block or the last full bin
+                            // of the previous block, we do not need to load the other block unnecessarily.
+                            bins.push_back(firstBinInThisBlock - 1);
+                        } else {
+                            bins.push_back(lastBinInPreviousBlock);
+                        }
+                    } else {
+                        bins.push_back(lastBinInPreviousBlock);
+                    }
+                    if (block.numObjects > 0) {
+                        StoreConfig::key_t key = block.keys[block.numObjects - 1];
+                        if (key == 0 && block.numObjects > 1) {
+                            // Terminator for the last object of a block range
+                            key = block.keys[block.numObjects - 2];
+                        }
+                        assert(key > lastKeyInPreviousBlock || key == 0);
+                        if (key != 0) {
+                            lastKeyInPreviousBlock = key;
+                        }
+                    }
+                    keysReadOfRange[thread] += block.numObjects;
+                    if (thread == 0) {
+                        LOG("Reading", blockIdx, endBlock);
+                    }
+                });
+                lastKeyOfRange[thread] = lastKeyInPreviousBlock;
+            });
+            LOG(nullptr);
+
+            numObjects = 0;
+            StoreConfig::key_t lastKeyBeforeRange = 0;
+            for (size_t thread = 0; thread < numThreads; thread++) {
+                size_t minimumBin = key2bin(lastKeyBeforeRange);
+                for (size_t bin : binsOfRange[thread]) {
+                    index->push_back(std::max(bin, minimumBin));
+                }
+                std::vector<size_t>().swap(binsOfRange[thread]);
+                if (lastKeyOfRange[thread] != 0) {
+                    lastKeyBeforeRange = lastKeyOfRange[thread];
+                }
+                numObjects += keysReadOfRange[thread];
+            }
+        }
+
+        template <class Iterator, typename HashFunction, typename LengthExtractor, typename ValuePointerExtractor,
+                typename PrefetchExtractor>
+        void writeToFileParallel(Iterator begin, Iterator end, HashFunction hashFunction,
+                                 LengthExtractor lengthExtractor, ValuePointerExtractor valuePointerExtractor,
+                                 PrefetchExtractor prefetchExtractor, size_t numThreads) {
+            constructionTimer.notifyDeterminedSpace();
+            numObjects = end - begin;
+            LOG("Sorting input keys");
+            parallelSort(begin, end, hashFunction, numThreads);
+
+            constructionTimer.notifyPlacedObjects();
+
+            // The packing of one block depends on the previous blocks, so it is determined sequentially.
+            // This only looks at the keys and lengths and is cheap compared to copying the objects.
+            LOG("Determining layout");
+            LinearObjectLayout layout(true, blockSlack);
+            for (Iterator it = begin; it != end; ++it) {
+                layout.add(hashFunction(*it), lengthExtractor(*it));
+            }
+            layout.close();
+            totalPayloadSize = layout.totalPayloadSize;
+
+            int fd = open(filename, O_RDWR | O_CREAT, 0666);
+            if (fd < 0) {
+                throw std::ios_base::failure("Unable to open " + std::string(filename)
+                         + ": " + std::string(strerror(errno)));
+            }
+            // If the file is a partition, truncating fails, so we silently ignore the result
+            int result = ftruncate(fd, layout.numBlocks * StoreConfig::BLOCK_LENGTH);
+            (void) result;
+            // Each writer only grows the preallocation of its own range, so reserve the whole file at once
+            result = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, layout.numBlocks * StoreConfig::BLOCK_LENGTH);
+            (void) result;
+
+            LOG("Writing");
+            size_t numChunks = layout.chunkStarts.size();
+            BlockRanges chunkRanges(numChunks, std::min(numThreads, numChunks), 1);
+            numThreads = chunkRanges.numThreads;
+            std::vector<size_t> writeStallOfThread(numThreads, 0);
+            try {
+                chunkRanges.inParallel([&](size_t thread) {
+                    size_t firstChunk = chunkRanges.firstBlock(thread);
+                    size_t lastChunk = chunkRanges.endBlock(thread);
+                    bool isLast = thread == numThreads - 1;
+                    size_t maxBlocks = isLast ? ~0ul : (lastChunk - firstChunk) * LinearObjectLayout::CHUNK_BLOCKS;
+                    LinearObjectWriter writer(filename, openFlags,
+                                              firstChunk * LinearObjectLayout::CHUNK_BLOCKS, maxBlocks, writeQueueDepth);
+                    writer.enableBlockSlack(blockSlack);
+                    LinearObjectLayout::BlockStart start = layout.chunkStarts.at(firstChunk);
+                    InputPrefetcher prefetcher(begin, start.object, numObjects, prefetchExtractor);
+                    for (size_t i = start.object; i < numObjects && writer.blocksGenerated < maxBlocks; i++) {
+                        prefetcher.beforeAccess(i);
+                        auto &item = begin[i];
+                        StoreConfig::key_t key = hashFunction(item);
+                        assert(key != 0); // Key 0 holds metadata
+                        size_t length = lengthExtractor(item);
+                        if (i == start.object && start.alreadyWritten > 0) {
+                            writer.writeContinuation(length, valueSource(valuePointerExtractor, item),
+                                                     start.alreadyWritten);
+                        } else {
+                            writer.write(key, length, valueSource(valuePointerExtractor, item));
+                        }
+                    }
+                    if (isLast) {
+                        writer.finish();
+                    } else {
+                        writer.flush();
+                        writer.awaitWrites();
+                    }
+                    writeStallOfThread[thread] = writer.writeStallNanoseconds();
+                });
+            } catch (...) {
+                close(fd);
+                throw;
+            }
+            // Threads stall concurrently, so report the longest stall rather than the sum
+            constructionTimer.notifyWriteStall(*std::max_element(writeStallOfThread.begin(), writeStallOfThread.end()));
+
+            StoreMetadata metadata;
+            metadata.numBlocks = layout.numBlocks;
+            metadata.maxSize = layout.maxSize;
+            metadata.type = StoreMetadata::TYPE_PACHASH;
+            metadata.indexOffset = layout.numBlocks * StoreConfig::BLOCK_LENGTH;
+            metadata.indexSize = IndexFooter::write(fd, metadata.indexOffset,
+                                                    layout.indexRecorder.encode(layout.numBlocks, a));
+            metadata.indexBinsPerBlock = a;
+            close(fd);
+            LinearObjectWriter::writeMetadata(filename, openFlags, metadata);
+            buildIndexAfterWriting(layout.indexRecorder, layout.numBlocks, layout.maxSize);
+            constructionTimer.notifyWroteObjects();
+        }
+
         inline void reconstruct(QueryHandle *&handle, size_t &i, BlockStorage &block,
                                 size_t &blockIdx, char *&blockPtr, size_t &blocksAccessed) {
             if (i < size_t(block.numObjects - 1)) {
@@ -210,41 +610,50 @@ class PaCHashObjectStore : public VariableSizeObjectStore {
                 // and the pointer does not need reconstruction. All is nice and easy.
                 handle->length = block.offsets[i + 1] - block.offsets[i];
                 handle->resultPtr = blockPtr + block.offsets[i];
+                handle->setContiguousFragment();
                 assert(handle->length <= maxSize);
                 handle->stats.notifyFoundKey();
                 handle->state = 0;
                 return;
             } else {
                 // Object overlaps. We need to find the size by examining the following blocks.
-                // Also, we need to reconstruct the object to remove the headers in the middle.
+                // Also, we need to reconstruct the object to remove the headers in the middle,
+                // unless the caller asked for the fragments.
                 char *resultPtr = blockPtr + block.offsets[i];
                 size_t length = block.tableStart - resultPtr - block.emptyPageEnd;
+                if (handle->resultForm == QueryHandle::ResultForm::FRAGMENTS) {
+                    handle->fragments.assign(1, iovec{resultPtr, length});
+                }
+                auto appendPart = [&](char *part, size_t partLength) {
+                    if (handle->resultForm == QueryHandle::ResultForm::FRAGMENTS) {
+                        if (partLength > 0) {
+                            handle->fragments.push_back(iovec{part, partLength});
+                        }
+                    } else if (handle->resultForm == QueryHandle::ResultForm::CONTIGUOUS_NON_TEMPORAL) {
+                        moveNonTemporal(resultPtr + length, part, partLength);
+                    } else {
+                        memmove(resultPtr + length, part, partLength);
+                    }
+                    length += partLength;
+                };
 
                 blockIdx++;
                 for(; blockIdx < blocksAccessed; blockIdx++) {
-                    char *nextBlockPtr = handle->buffer + blockIdx * StoreConfig::BLOCK_LENGTH;
+                    char *nextBlockPtr = handle->readBuffer() + blockIdx * StoreConfig::BLOCK_LENGTH;
                     BlockStorage nextBlock(nextBlockPtr);
                     if (nextBlock.numObjects > 0) {
                         // We found the next object and therefore the end of this one.
-                        StoreConfig::offset_t lengthOnNextBlock = nextBlock.offsets[0];
-                        memmove(resultPtr + length, nextBlock.blockStart, lengthOnNextBlock);
-                        length += lengthOnNextBlock;
-
-                        handle->length = length;
-                        handle->resultPtr = resultPtr;
-                        assert(length <= maxSize);
-                        handle->stats.notifyFoundKey();
-                        handle->state = 0;
-                        return;
+                        appendPart(nextBlock.blockStart, nextBlock.offsets[0]);
+                        break;
                     } else {
                         // Fully overlapped. We have to copy the whole block and continue searching.
-                        size_t lengthOnNextBlock = nextBlock.tableStart - nextBlock.blockStart;
-                        memmove(resultPtr + length, nextBlock.blockStart, lengthOnNextBlock);
-                        length += lengthOnNextBlock - nextBlock.emptyPageEnd;
+                        appendPart(nextBlock.blockStart,
+                                   nextBlock.tableStart - nextBlock.blockStart - nextBlock.emptyPageEnd);
                     }
                 }
 
-                // Special case. Object fills the last loaded block exactly. We did not load the next one.
+                // If the loop ended without break, the object fills the last loaded block exactly.
+                // We did not load the next one.
                 handle->length = length;
                 handle->resultPtr = resultPtr;
                 assert(handle->length <= maxSize);
@@ -259,19 +668,19 @@ class PaCHashObjectStore : public VariableSizeObjectStore {
             size_t blocksAccessed = handle->length;
 
             for (size_t blockIdx = 0; blockIdx < blocksAccessed; blockIdx++) {
-                char *blockPtr = handle->buffer + blockIdx * StoreConfig::BLOCK_LENGTH;
+                char *blockPtr = handle->readBuffer() + blockIdx * StoreConfig::BLOCK_LENGTH;
                 BlockStorage block(blockPtr);
-                for (size_t i = 0; i < block.numObjects; i++) {
-                    if (handle->key == block.keys[i]) [[unlikely]] {
-                        reconstruct(handle, i, block, blockIdx, blockPtr, blocksAccessed);
-                        return;
-                    }
+                size_t i = findKeyInSortedTable(block.keys, block.numObjects, handle->key);
+                if (i < block.numObjects) {
+                    reconstruct(handle, i, block, blockIdx, blockPtr, blocksAccessed);
+                    return;
                 }
             }
 
             // Did not find object
             handle->length = 0;
             handle->resultPtr = nullptr;
+            handle->fragments.clear();
             handle->stats.notifyFoundKey();
             handle->state = 0;
         }
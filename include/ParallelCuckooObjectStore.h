@@ -1,11 +1,14 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
+#include <bytehamster/util/XorShift64.h>
 
 #include "StoreConfig.h"
 #include "VariableSizeObjectStore.h"
 #include "IoManager.h"
 #include "BlockObjectWriter.h"
+#include "BlockIterator.h"
 
 namespace pachash {
 /**
@@ -15,10 +18,25 @@ class ParallelCuckooObjectStore : public VariableSizeObjectStore {
     private:
         using Super = VariableSizeObjectStore;
         using Item = typename BlockObjectWriter::Item;
-        using Block = typename BlockObjectWriter::Block;
-        std::vector<Block> blocks;
-        std::vector<Item> insertionQueue;
+        BlockObjectWriter::Blocks blocks;
+        std::vector<uint32_t> insertionQueue;
+        bytehamster::util::XorShift64 prng;
+        struct BfsNode {
+            size_t block;
+            size_t overflow;
+            size_t parent;
+            uint32_t item; // Moved from the block of the parent to this block
+            uint32_t previous; // Predecessor of the item in the block of the parent
+        };
+        std::vector<BfsNode> bfsNodes;
+        std::vector<size_t> bfsVisited;
+        size_t bfsSearch = 0;
     public:
+        static constexpr size_t MAX_BFS_NODES = 500;
+        // Seed of the random walk that is used when the breadth-first search does not find a path.
+        // Construction is reproducible for the same seed.
+        uint64_t seed = 0;
+
         explicit ParallelCuckooObjectStore(float loadFactor, const char* filename, int openFlags)
                 : VariableSizeObjectStore(loadFactor, filename, openFlags) {
         }
@@ -27,13 +45,32 @@ class ParallelCuckooObjectStore : public VariableSizeObjectStore {
             return "ParallelCuckooObjectStore";
         }
 
+        /**
+         * Places the objects in blocks and writes them to the file.
+         * With multiple threads, the objects are first inserted without evictions in parallel,
+         * see insertWithoutEvictions(). The extractor functions are then called concurrently and must be thread-safe.
+         * The resulting file is the same for every number of threads.
+         */
         template <class Iterator, typename HashFunction, typename LengthExtractor, typename ValuePointerExtractor,
                 class U = typename std::iterator_traits<Iterator>::value_type>
         void writeToFile(Iterator begin, Iterator end, HashFunction hashFunction,
-                         LengthExtractor lengthExtractor, ValuePointerExtractor valuePointerExtractor) {
+                         LengthExtractor lengthExtractor, ValuePointerExtractor valuePointerExtractor,
+                         size_t numThreads = 1) {
+            static_assert(isValueExtractor<ValuePointerExtractor, U>);
+            placeObjects(begin, end, hashFunction, lengthExtractor, numThreads);
+            writePlacedObjects<ValuePointerExtractor, U>(valuePointerExtractor);
+        }
+
+        /**
+         * First step of writeToFile(). Determines the blocks of all objects, without accessing their values.
+         * Throws if the objects do not fit or if construction is cancelled.
+         */
+        template <class Iterator, typename HashFunction, typename LengthExtractor,
+                class U = typename std::iterator_traits<Iterator>::value_type>
+        void placeObjects(Iterator begin, Iterator end, HashFunction hashFunction,
+                          LengthExtractor lengthExtractor, size_t numThreads = 1) {
             static_assert(std::is_invocable_r_v<StoreConfig::key_t, HashFunction, U>);
             static_assert(std::is_invocable_r_v<size_t, LengthExtractor, U>);
-            static_assert(std::is_invocable_r_v<const char *, ValuePointerExtractor, U>);
             constructionTimer.notifyStartConstruction();
             LOG("Calculating total size to determine number of blocks");
             numObjects = end-begin;
@@ -51,27 +88,44 @@ class ParallelCuckooObjectStore : public VariableSizeObjectStore {
             spaceNeeded += spaceNeeded / StoreConfig::BLOCK_LENGTH * overheadPerBlock;
             numBlocks = size_t(float(spaceNeeded) / loadFactor) / StoreConfig::BLOCK_LENGTH;
             blocks.resize(numBlocks);
+            blocks.resizeItems(numObjects);
             constructionTimer.notifyDeterminedSpace();
 
-            it = begin;
-            for (size_t i = 0; i < numObjects; i++) {
-                StoreConfig::key_t key = hashFunction(*it);
+            LOG("Inserting");
+            std::vector<uint32_t> notInserted = insertWithoutEvictions(numThreads, [&](size_t i) {
+                throwIfConstructionCancelled();
+                StoreConfig::key_t key = hashFunction(begin[i]);
                 assert(key != 0); // Key 0 holds metadata
-                size_t size = lengthExtractor(*it);
-                insert(key, size, &*it);
-                LOG("Inserting", i, numObjects);
-                it++;
+                blocks.items[i] = Item{key, &begin[i], uint32_t(lengthExtractor(begin[i])), 0, 0,
+                                       BlockObjectWriter::NO_ITEM};
+            });
+            prng = bytehamster::util::XorShift64(seed);
+            bfsVisited.assign(numBlocks, 0);
+            for (size_t i = 0; i < notInserted.size(); i++) {
+                insertionQueue.push_back(notInserted[i]);
+                handleInsertionQueue();
+                LOG("Inserting with evictions", i, notInserted.size());
             }
             constructionTimer.notifyPlacedObjects();
-            BlockObjectWriter::writeBlocks<ValuePointerExtractor, U>(
+            insertionQueue.shrink_to_fit();
+            bfsNodes.shrink_to_fit();
+            bfsVisited = std::vector<size_t>();
+        }
+
+        /**
+         * Second step of writeToFile(). Writes the objects placed by placeObjects().
+         */
+        template <typename ValuePointerExtractor, class U>
+        void writePlacedObjects(ValuePointerExtractor valuePointerExtractor) {
+            size_t writeStall = BlockObjectWriter::writeBlocks<ValuePointerExtractor, U>(
                     filename, openFlags, maxSize, blocks,
-                    valuePointerExtractor, VariableSizeObjectStore::StoreMetadata::TYPE_CUCKOO);
+                    valuePointerExtractor, VariableSizeObjectStore::StoreMetadata::TYPE_CUCKOO, writeQueueDepth);
+            constructionTimer.notifyWriteStall(writeStall);
             constructionTimer.notifyWroteObjects();
             blocks.clear();
-            blocks.shrink_to_fit();
         }
 
-        void writeToFile(std::vector<std::pair<std::string, std::string>> &vector) {
+        void writeToFile(std::vector<std::pair<std::string, std::string>> &vector, size_t numThreads = 1) {
             auto hashFunction = [](const std::pair<std::string, std::string> &x) -> StoreConfig::key_t {
                 return bytehamster::util::MurmurHash64(std::get<0>(x).data(), std::get<0>(x).length());
             };
@@ -81,10 +135,10 @@ class ParallelCuckooObjectStore : public VariableSizeObjectStore {
             auto valueEx = [](const std::pair<std::string, std::string> &x) -> const char * {
                 return std::get<1>(x).data();
             };
-            writeToFile(vector.begin(), vector.end(), hashFunction, lengthEx, valueEx);
+            writeToFile(vector.begin(), vector.end(), hashFunction, lengthEx, valueEx, numThreads);
         }
 
-        void buildIndex() final {
+        void buildIndex([[maybe_unused]] size_t numThreads = 1) final {
             constructionTimer.notifySyncedFile();
             LOG("Looking up file size");
             StoreMetadata metadata = readMetadata(filename);
@@ -115,45 +169,176 @@ class ParallelCuckooObjectStore : public VariableSizeObjectStore {
         }
 
     private:
-        void insert(StoreConfig::key_t key, size_t length, void *originalObject) {
-            Item item{key, length, 0, 0, originalObject};
-            insertionQueue.push_back(item);
-            handleInsertionQueue();
+        size_t block(const Item &item) {
+            return bytehamster::util::fastrange64(
+                bytehamster::util::MurmurHash64Seeded(item.key, item.hashFunctionIndex % 2), numBlocks);
+        }
+
+        size_t otherBlock(const Item &item) {
+            return bytehamster::util::fastrange64(
+                bytehamster::util::MurmurHash64Seeded(item.key, (item.hashFunctionIndex + 1) % 2), numBlocks);
+        }
+
+        [[nodiscard]] static size_t capacity(size_t block) {
+            size_t maxSize = StoreConfig::BLOCK_LENGTH - overheadPerBlock;
+            if (block == 0) {
+                maxSize -= overheadPerObject + sizeof(VariableSizeObjectStore::StoreMetadata);
+            }
+            return maxSize;
+        }
+
+        /**
+         * Each thread owns a range of blocks. The threads first initialize their share of the items with
+         * initItem(i). Items are then offered to their first block and, if it is full, to their second block.
+         * A block accepts an item if it has enough space left, without evicting others.
+         * The items arrive at each block in input order, so the result does not depend on the number of threads.
+         * Returns the items that fit into neither block, in input order.
+         */
+        template <typename InitItem>
+        std::vector<uint32_t> insertWithoutEvictions(size_t numThreads, InitItem initItem) {
+            BlockRanges ranges(numBlocks, std::min(numThreads, numBlocks), 1);
+            numThreads = ranges.numThreads;
+            auto tryAppend = [&](uint32_t itemIndex) {
+                throwIfConstructionCancelled();
+                const Item &item = blocks.items[itemIndex];
+                size_t b = block(item);
+                if (blocks.at(b).length + item.length + overheadPerObject > capacity(b)) {
+                    return false;
+                }
+                blocks.append(b, itemIndex);
+                blocks.at(b).length += item.length + overheadPerObject;
+                return true;
+            };
+
+            ThreadMailboxes<uint32_t> toFirstBlock(numThreads);
+            ThreadMailboxes<uint32_t> toSecondBlock(numThreads);
+            std::vector<std::vector<uint32_t>> notInserted(numThreads);
+            size_t numItems = blocks.items.size();
+            ranges.inParallel([&](size_t thread) {
+                for (size_t i = numItems * thread / numThreads; i < numItems * (thread + 1) / numThreads; i++) {
+                    initItem(i);
+                    toFirstBlock.send(thread, ranges.rangeOf(block(blocks.items[i])), i);
+                }
+            });
+            ranges.inParallel([&](size_t thread) {
+                // The threads handled consecutive ranges of the input, so this is in input order
+                std::vector<uint32_t> items;
+                toFirstBlock.receive(thread, items);
+                for (uint32_t item : items) {
+                    if (!tryAppend(item)) {
+                        blocks.items[item].hashFunctionIndex++;
+                        toSecondBlock.send(thread, ranges.rangeOf(block(blocks.items[item])), item);
+                    }
+                }
+            });
+            ranges.inParallel([&](size_t thread) {
+                std::vector<uint32_t> items;
+                toSecondBlock.receive(thread, items);
+                std::sort(items.begin(), items.end());
+                for (uint32_t item : items) {
+                    if (!tryAppend(item)) {
+                        notInserted[thread].push_back(item);
+                    }
+                }
+            });
+            std::vector<uint32_t> result;
+            for (std::vector<uint32_t> &items : notInserted) {
+                result.insert(result.end(), items.begin(), items.end());
+            }
+            std::sort(result.begin(), result.end());
+            return result;
         }
 
         void handleInsertionQueue() {
+            size_t randomWalkSteps = 0;
             while (!insertionQueue.empty()) {
-                Item item = insertionQueue.back();
+                throwIfConstructionCancelled();
+                uint32_t itemIndex = insertionQueue.back();
                 insertionQueue.pop_back();
+                const Item &item = blocks.items[itemIndex];
 
-                size_t block = bytehamster::util::fastrange64(
-                    bytehamster::util::MurmurHash64Seeded(item.key, item.hashFunctionIndex % 2), numBlocks);
-                blocks.at(block).items.push_back(item);
-                blocks.at(block).length += item.length + overheadPerObject;
-
-                size_t maxSize = StoreConfig::BLOCK_LENGTH - overheadPerBlock;
-                if (block == 0) {
-                    maxSize -= overheadPerObject + sizeof(VariableSizeObjectStore::StoreMetadata);
+                size_t b = block(item);
+                blocks.append(b, itemIndex);
+                blocks.at(b).length += item.length + overheadPerObject;
+                if (blocks.at(b).length <= capacity(b) || makeRoom(b)) {
+                    continue;
                 }
-                while (blocks.at(block).length > maxSize) {
-                    size_t bumpedItemIndex = rand() % blocks.at(block).items.size();
-                    auto it = blocks.at(block).items.begin();
-                    std::advance(it, bumpedItemIndex);
-                    Item bumpedItem = *it;
-                    bumpedItem.hashFunctionIndex++;
-                    if (item.hashFunctionIndex > 100) {
+                while (blocks.at(b).length > capacity(b)) {
+                    size_t bumpedItemIndex = prng(blocks.at(b).numItems);
+                    uint32_t previous = BlockObjectWriter::NO_ITEM;
+                    for (size_t i = 0; i < bumpedItemIndex; i++) {
+                        previous = previous == BlockObjectWriter::NO_ITEM
+                                ? blocks.at(b).firstItem : blocks.items[previous].next;
+                    }
+                    if (++randomWalkSteps > 100) {
                         // Empirically, making this number larger does not increase the success probability
                         // but increases the duration of failed construction attempts significantly.
                         throw std::invalid_argument("Unable to insert item. Try reducing the load factor.");
                     }
 
-                    blocks.at(block).items.erase(it);
-                    blocks.at(block).length -= bumpedItem.length + overheadPerObject;
+                    uint32_t bumpedItem = blocks.removeAfter(b, previous);
+                    blocks.items[bumpedItem].hashFunctionIndex++;
+                    blocks.at(b).length -= blocks.items[bumpedItem].length + overheadPerObject;
                     insertionQueue.push_back(bumpedItem);
                 }
             }
         }
 
+        /**
+         * Breadth-first search for the shortest sequence of items that can be moved to their other block,
+         * so that the overflowing block and all blocks on the way fit again.
+         * Moving an item only resolves the overflow of a block if it is at least as large as the overflow.
+         * Returns false if there is no such sequence within the first MAX_BFS_NODES blocks.
+         */
+        bool makeRoom(size_t overflowingBlock) {
+            bfsSearch++;
+            bfsNodes.clear();
+            bfsNodes.push_back(BfsNode{overflowingBlock, blocks.at(overflowingBlock).length - capacity(overflowingBlock),
+                                       0, BlockObjectWriter::NO_ITEM, BlockObjectWriter::NO_ITEM});
+            bfsVisited[overflowingBlock] = bfsSearch;
+            for (size_t node = 0; node < bfsNodes.size() && bfsNodes.size() < MAX_BFS_NODES; node++) {
+                size_t from = bfsNodes[node].block;
+                size_t overflow = bfsNodes[node].overflow;
+                uint32_t previous = BlockObjectWriter::NO_ITEM;
+                for (uint32_t i = blocks.at(from).firstItem; i != BlockObjectWriter::NO_ITEM;
+                            previous = i, i = blocks.items[i].next) {
+                    const Item &item = blocks.items[i];
+                    size_t size = item.length + overheadPerObject;
+                    size_t to = otherBlock(item);
+                    if (size < overflow || bfsVisited[to] == bfsSearch) {
+                        continue;
+                    }
+                    bfsVisited[to] = bfsSearch;
+                    size_t length = blocks.at(to).length + size;
+                    bfsNodes.push_back(BfsNode{to, length > capacity(to) ? length - capacity(to) : 0, node, i, previous});
+                    if (length <= capacity(to)) {
+                        movePath(bfsNodes.size() - 1);
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        /**
+         * Move the items on the path from the root of the breadth-first search to the given node.
+         * Each block loses at most one item, so the predecessors stay valid while removing.
+         */
+        void movePath(size_t lastNode) {
+            for (size_t node = lastNode; node != 0; node = bfsNodes[node].parent) {
+                const BfsNode &bfsNode = bfsNodes[node];
+                size_t from = bfsNodes[bfsNode.parent].block;
+                blocks.removeAfter(from, bfsNode.previous);
+                blocks.at(from).length -= blocks.items[bfsNode.item].length + overheadPerObject;
+            }
+            for (size_t node = lastNode; node != 0; node = bfsNodes[node].parent) {
+                const BfsNode &bfsNode = bfsNodes[node];
+                blocks.items[bfsNode.item].hashFunctionIndex++;
+                blocks.append(bfsNode.block, bfsNode.item);
+                blocks.at(bfsNode.block).length += blocks.items[bfsNode.item].length + overheadPerObject;
+            }
+        }
+
     public:
         template <typename IoManager>
         void enqueueQuery(QueryHandle *handle, IoManager ioManager) {
@@ -167,9 +352,11 @@ class ParallelCuckooObjectStore : public VariableSizeObjectStore {
             size_t blockIndex2 = bytehamster::util::fastrange64(
                 bytehamster::util::MurmurHash64Seeded(handle->key, 1), numBlocks);
             handle->stats.notifyFoundBlock(2);
-            ioManager->enqueueRead(handle->buffer, blockIndex1 * StoreConfig::BLOCK_LENGTH, StoreConfig::BLOCK_LENGTH,
+            handle->acquireBuffer(2 * StoreConfig::BLOCK_LENGTH);
+            ioManager->enqueueRead(handle->readBuffer(),
+                                   blockIndex1 * StoreConfig::BLOCK_LENGTH, StoreConfig::BLOCK_LENGTH,
                                    reinterpret_cast<uint64_t>(handle));
-            ioManager->enqueueRead(handle->buffer + StoreConfig::BLOCK_LENGTH,
+            ioManager->enqueueRead(handle->readBuffer() + StoreConfig::BLOCK_LENGTH,
                                    blockIndex2 * StoreConfig::BLOCK_LENGTH, StoreConfig::BLOCK_LENGTH,
                                    reinterpret_cast<uint64_t>(handle));
         }
@@ -191,12 +378,14 @@ class ParallelCuckooObjectStore : public VariableSizeObjectStore {
             handle->stats.notifyFetchedBlock();
 
             std::tuple<size_t, char *> result
-                    = findKeyWithinNonOverlappingBlock(handle->key, handle->buffer);
+                    = findKeyWithinNonOverlappingBlock(handle->key, handle->readBuffer());
             if (std::get<1>(result) == nullptr) {
-                result = findKeyWithinNonOverlappingBlock(handle->key, handle->buffer + StoreConfig::BLOCK_LENGTH);
+                result = findKeyWithinNonOverlappingBlock(handle->key,
+                                                          handle->readBuffer() + StoreConfig::BLOCK_LENGTH);
             }
             handle->length = std::get<0>(result);
             handle->resultPtr = std::get<1>(result);
+            handle->setContiguousFragment();
             handle->stats.notifyFoundKey();
             handle->state = 0;
             return handle;
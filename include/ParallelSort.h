@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <ips2ra.hpp>
+#include <bytehamster/util/Function.h>
+#include "BlockIterator.h"
+
+namespace pachash {
+/**
+ * Sorts the range by the given 64-bit key using multiple threads.
+ * The keys are hash values, so distributing by the most significant bits results in balanced buckets.
+ * Each thread scatters a part of the input to the buckets, then the buckets are sorted independently.
+ * Needs temporary space for a copy of the input.
+ * If a thread throws, the error is rethrown after all threads have finished. The range is then in an unspecified state.
+ */
+template <class Iterator, typename KeyExtractor, class U = typename std::iterator_traits<Iterator>::value_type>
+void parallelSort(Iterator begin, Iterator end, KeyExtractor keyExtractor, size_t numThreads) {
+    size_t n = end - begin;
+    if (numThreads <= 1 || n < 1024 * numThreads) {
+        ips2ra::sort(begin, end, keyExtractor);
+        return;
+    }
+    const size_t bucketBits = bytehamster::util::ceillog2(16 * numThreads);
+    const size_t numBuckets = 1ul << bucketBits;
+    auto bucketOf = [&](const U &x) -> size_t {
+        return keyExtractor(x) >> (64 - bucketBits);
+    };
+    BlockRanges ranges(n, numThreads, 1);
+
+    std::vector<std::vector<size_t>> bucketPositions(numThreads, std::vector<size_t>(numBuckets, 0));
+    ranges.inParallel([&](size_t thread) {
+        for (size_t i = ranges.firstBlock(thread); i < ranges.endBlock(thread); i++) {
+            bucketPositions[thread][bucketOf(begin[i])]++;
+        }
+    });
+    std::vector<size_t> bucketStarts(numBuckets + 1);
+    size_t position = 0;
+    for (size_t bucket = 0; bucket < numBuckets; bucket++) {
+        bucketStarts[bucket] = position;
+        for (size_t thread = 0; thread < numThreads; thread++) {
+            size_t count = bucketPositions[thread][bucket];
+            bucketPositions[thread][bucket] = position;
+            position += count;
+        }
+    }
+    bucketStarts[numBuckets] = n;
+
+    std::allocator<U> allocator;
+    U *temp = allocator.allocate(n);
+    try {
+        ranges.inParallel([&](size_t thread) {
+            for (size_t i = ranges.firstBlock(thread); i < ranges.endBlock(thread); i++) {
+                std::construct_at(temp + bucketPositions[thread][bucketOf(begin[i])]++, std::move(begin[i]));
+            }
+        });
+        std::atomic<size_t> nextBucket = 0;
+        ranges.inParallel([&](size_t) {
+            size_t bucket;
+            while ((bucket = nextBucket++) < numBuckets) {
+                for (size_t i = bucketStarts[bucket]; i < bucketStarts[bucket + 1]; i++) {
+                    begin[i] = std::move(temp[i]);
+                    std::destroy_at(temp + i);
+                }
+                ips2ra::sort(begin + bucketStarts[bucket], begin + bucketStarts[bucket + 1], keyExtractor);
+            }
+        });
+    } catch (...) {
+        allocator.deallocate(temp, n);
+        throw;
+    }
+    allocator.deallocate(temp, n);
+}
+} // Namespace pachash
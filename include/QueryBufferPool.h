@@ -0,0 +1,63 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+#include "StoreConfig.h"
+
+namespace pachash {
+/**
+ * Recycles the buffers of query handles, so that each query only occupies a buffer of about the size
+ * that it actually reads instead of the worst case of requiredBufferPerQuery().
+ * Buffers are grouped into size classes of a power of two blocks and aligned to the block length.
+ * Freed buffers are kept for later queries of the same class and only deallocated with the pool.
+ * Not thread-safe: use one pool per thread, like an ObjectStoreView. It has to outlive its handles.
+ */
+class QueryBufferPool {
+    private:
+        // Free buffers of 2^i blocks at index i
+        std::vector<std::vector<char *>> freeBuffers;
+    public:
+        size_t allocatedBytes = 0;
+
+        QueryBufferPool() = default;
+        QueryBufferPool(const QueryBufferPool &) = delete;
+        QueryBufferPool &operator=(const QueryBufferPool &) = delete;
+
+        ~QueryBufferPool() {
+            for (std::vector<char *> &buffers : freeBuffers) {
+                for (char *buffer : buffers) {
+                    operator delete[](buffer, std::align_val_t(StoreConfig::BLOCK_LENGTH));
+                }
+            }
+        }
+
+        [[nodiscard]] static size_t sizeClass(size_t length) {
+            size_t blocks = (length + StoreConfig::BLOCK_LENGTH - 1) / StoreConfig::BLOCK_LENGTH;
+            return blocks <= 1 ? 0 : std::bit_width(blocks - 1);
+        }
+
+        [[nodiscard]] static size_t capacity(size_t sizeClass) {
+            return size_t(StoreConfig::BLOCK_LENGTH) << sizeClass;
+        }
+
+        char *allocate(size_t sizeClass) {
+            if (sizeClass < freeBuffers.size() && !freeBuffers[sizeClass].empty()) {
+                char *buffer = freeBuffers[sizeClass].back();
+                freeBuffers[sizeClass].pop_back();
+                return buffer;
+            }
+            allocatedBytes += capacity(sizeClass);
+            return new (std::align_val_t(StoreConfig::BLOCK_LENGTH)) char[capacity(sizeClass)];
+        }
+
+        void release(char *buffer, size_t sizeClass) {
+            if (sizeClass >= freeBuffers.size()) {
+                freeBuffers.resize(sizeClass + 1);
+            }
+            freeBuffers[sizeClass].push_back(buffer);
+        }
+};
+} // Namespace pachash
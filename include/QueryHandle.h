@@ -1,26 +1,118 @@
 #pragma once
 
+#include <sys/uio.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
 #include <bytehamster/util/MurmurHash64.h>
 #include "VariableSizeObjectStore.h"
+#include "QueryBufferPool.h"
 
 namespace pachash {
 struct QueryHandle {
+    /**
+     * How PaCHashObjectStore returns objects that span multiple blocks.
+     * CONTIGUOUS moves the parts over the block tables in the buffer, so that resultPtr points to the whole object.
+     * CONTIGUOUS_NON_TEMPORAL does the same with stores that bypass the cache, for large objects.
+     * FRAGMENTS does not copy. The parts are listed in fragments, which can be passed to writev() directly.
+     */
+    enum class ResultForm : uint8_t {
+        CONTIGUOUS, CONTIGUOUS_NON_TEMPORAL, FRAGMENTS
+    };
+
     StoreConfig::key_t key = 0;
     size_t length = 0;
     char *resultPtr = nullptr;
     char *buffer = nullptr;
+    // If not null, the blocks are read into this caller-supplied memory instead of the buffer,
+    // so resultPtr points into it. Set by ObjectStoreView::enqueueQuery(handle, destination, size).
+    char *destination = nullptr;
+    size_t destinationSize = 0;
+    // If not null, the buffer is drawn from this pool for each query, see acquireBuffer().
+    QueryBufferPool *bufferPool = nullptr;
+    size_t bufferSizeClass = 0;
+    ResultForm resultForm = ResultForm::CONTIGUOUS;
+    // With ResultForm::FRAGMENTS, the parts of the object in the buffer. Empty if the key was not found.
+    // resultPtr points to the first part, length is the total length.
+    // Stores other than PaCHashObjectStore never split objects, so they return a single fragment.
+    std::vector<iovec> fragments;
     QueryTimer stats = {};
     uint16_t state = 0;
     // Can be used freely by users to identify handles returned by the awaitAny method.
     uint64_t name = 0;
 
+    /**
+     * Handle without a buffer of its own, for queries that are only ever enqueued with a destination.
+     */
+    QueryHandle() = default;
+
     template <class ObjectStore>
     explicit QueryHandle(ObjectStore &objectStore) {
         buffer = new (std::align_val_t(pachash::StoreConfig::BLOCK_LENGTH)) char[objectStore.requiredBufferPerQuery()];
     }
 
+    /**
+     * Handle that draws a buffer of the size needed by each query from the pool, instead of allocating
+     * requiredBufferPerQuery() up front. The result stays valid until the handle is enqueued again
+     * or releaseBuffer() is called.
+     */
+    explicit QueryHandle(QueryBufferPool &bufferPool) : bufferPool(&bufferPool) {
+    }
+
     ~QueryHandle() {
-        delete[] buffer;
+        if (bufferPool != nullptr) {
+            releaseBuffer();
+        } else {
+            operator delete[](buffer, std::align_val_t(pachash::StoreConfig::BLOCK_LENGTH));
+        }
+    }
+
+    /**
+     * Called by the object stores when enqueueing a query, with the number of bytes they read into readBuffer().
+     * Throws if the destination is too small, which also cancels the query.
+     * Handles with a buffer pool return the buffer of the previous query and draw one that fits.
+     */
+    void acquireBuffer(size_t length) {
+        if (destination != nullptr) {
+            if (length > destinationSize) {
+                state = 0;
+                throw std::invalid_argument("Destination of " + std::to_string(destinationSize)
+                        + " bytes is smaller than the " + std::to_string(length) + " bytes read by the query");
+            }
+            return;
+        }
+        if (bufferPool == nullptr) {
+            return;
+        }
+        releaseBuffer();
+        bufferSizeClass = QueryBufferPool::sizeClass(length);
+        buffer = bufferPool->allocate(bufferSizeClass);
+    }
+
+    /**
+     * Returns the buffer to the pool before the next query, when the result is no longer needed.
+     */
+    void releaseBuffer() {
+        if (bufferPool != nullptr && buffer != nullptr) {
+            bufferPool->release(buffer, bufferSizeClass);
+            buffer = nullptr;
+        }
+    }
+
+    /**
+     * Fills the fragments for stores that return the whole object contiguously.
+     */
+    void setContiguousFragment() {
+        if (resultForm == ResultForm::FRAGMENTS) {
+            fragments.clear();
+            if (resultPtr != nullptr) {
+                fragments.push_back(iovec{resultPtr, length});
+            }
+        }
+    }
+
+    [[nodiscard]] char *readBuffer() const {
+        return destination != nullptr ? destination : buffer;
     }
 
     template <typename U, typename HashFunction>
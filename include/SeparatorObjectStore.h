@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <random>
+#include <algorithm>
 
 #include "StoreConfig.h"
 #include "VariableSizeObjectStore.h"
@@ -20,11 +21,9 @@ class SeparatorObjectStore : public VariableSizeObjectStore {
     private:
         using Super = VariableSizeObjectStore;
         using Item = typename BlockObjectWriter::Item;
-        using Block = typename BlockObjectWriter::Block;
         size_t numQueries = 0;
         size_t numInternalProbes = 0;
-        std::vector<Block> blocks;
-        std::vector<Item> insertionQueue;
+        BlockObjectWriter::Blocks blocks;
         bytehamster::util::IntVector<separatorBits> separators;
     public:
         explicit SeparatorObjectStore(float loadFactor, const char* filename, int openFlags)
@@ -35,13 +34,32 @@ class SeparatorObjectStore : public VariableSizeObjectStore {
             return "SeparatorObjectStore s=" + std::to_string(separatorBits);
         }
 
+        /**
+         * Places the objects in blocks and writes them to the file.
+         * With multiple threads, each thread places the objects in a range of blocks,
+         * see placeItems(). The extractor functions are then called concurrently and must be thread-safe.
+         * The resulting file is the same for every number of threads.
+         */
         template <class Iterator, typename HashFunction, typename LengthExtractor, typename ValuePointerExtractor,
                 class U = typename std::iterator_traits<Iterator>::value_type>
         void writeToFile(Iterator begin, Iterator end, HashFunction hashFunction,
-                         LengthExtractor lengthExtractor, ValuePointerExtractor valuePointerExtractor) {
+                         LengthExtractor lengthExtractor, ValuePointerExtractor valuePointerExtractor,
+                         size_t numThreads = 1) {
+            static_assert(isValueExtractor<ValuePointerExtractor, U>);
+            placeObjects(begin, end, hashFunction, lengthExtractor, numThreads);
+            writePlacedObjects<ValuePointerExtractor, U>(valuePointerExtractor);
+        }
+
+        /**
+         * First step of writeToFile(). Determines the blocks of all objects, without accessing their values.
+         * Throws if the objects do not fit or if construction is cancelled.
+         */
+        template <class Iterator, typename HashFunction, typename LengthExtractor,
+                class U = typename std::iterator_traits<Iterator>::value_type>
+        void placeObjects(Iterator begin, Iterator end, HashFunction hashFunction,
+                          LengthExtractor lengthExtractor, size_t numThreads = 1) {
             static_assert(std::is_invocable_r_v<StoreConfig::key_t, HashFunction, U>);
             static_assert(std::is_invocable_r_v<size_t, LengthExtractor, U>);
-            static_assert(std::is_invocable_r_v<const char *, ValuePointerExtractor, U>);
             constructionTimer.notifyStartConstruction();
             LOG("Calculating total size to determine number of blocks");
             numObjects = end - begin;
@@ -54,38 +72,44 @@ class SeparatorObjectStore : public VariableSizeObjectStore {
                 maxSize = std::max(maxSize, length);
                 it++;
             }
+            totalPayloadSize += spaceNeeded;
             spaceNeeded += numObjects * overheadPerObject;
             spaceNeeded += spaceNeeded / StoreConfig::BLOCK_LENGTH * overheadPerBlock;
             numBlocks = (spaceNeeded / loadFactor) / StoreConfig::BLOCK_LENGTH;
             blocks.resize(numBlocks);
+            blocks.resizeItems(numObjects);
             constructionTimer.notifyDeterminedSpace();
 
             separators.resize(numBlocks);
             for (size_t i = 0; i < numBlocks; i++) {
                 separators.set(i, (1 << separatorBits) - 1);
             }
-            it = begin;
-            for (size_t i = 0; i < numObjects; i++) {
-                StoreConfig::key_t key = hashFunction(*it);
+            LOG("Inserting");
+            placeItems(numThreads, [&](size_t i) {
+                throwIfConstructionCancelled();
+                StoreConfig::key_t key = hashFunction(begin[i]);
                 assert(key != 0); // Key 0 holds metadata
-                size_t size = lengthExtractor(*it);
-                totalPayloadSize += size;
-
-                insert(key, size, &*it);
-                LOG("Inserting", i, numObjects);
-                it++;
-            }
+                blocks.items[i] = Item{key, &begin[i], uint32_t(lengthExtractor(begin[i])), 0, 0,
+                                       BlockObjectWriter::NO_ITEM};
+            });
 
             constructionTimer.notifyPlacedObjects();
-            BlockObjectWriter::writeBlocks<ValuePointerExtractor, U>(
-                    filename, openFlags, maxSize, blocks,
-                    valuePointerExtractor, VariableSizeObjectStore::StoreMetadata::TYPE_SEPARATOR + separatorBits);
+        }
+
+        /**
+         * Second step of writeToFile(). Writes the objects placed by placeObjects().
+         */
+        template <typename ValuePointerExtractor, class U>
+        void writePlacedObjects(ValuePointerExtractor valuePointerExtractor) {
+            size_t writeStall = BlockObjectWriter::writeBlocks<ValuePointerExtractor, U>(
+                    filename, openFlags, maxSize, blocks, valuePointerExtractor,
+                    VariableSizeObjectStore::StoreMetadata::TYPE_SEPARATOR + separatorBits, writeQueueDepth);
+            constructionTimer.notifyWriteStall(writeStall);
             constructionTimer.notifyWroteObjects();
             blocks.clear();
-            blocks.shrink_to_fit();
         }
 
-        void writeToFile(std::vector<std::pair<std::string, std::string>> &vector) {
+        void writeToFile(std::vector<std::pair<std::string, std::string>> &vector, size_t numThreads = 1) {
             auto hashFunction = [](const std::pair<std::string, std::string> &x) -> StoreConfig::key_t {
                 return bytehamster::util::MurmurHash64(std::get<0>(x).data(), std::get<0>(x).length());
             };
@@ -95,10 +119,10 @@ class SeparatorObjectStore : public VariableSizeObjectStore {
             auto valueEx = [](const std::pair<std::string, std::string> &x) -> const char * {
                 return std::get<1>(x).data();
             };
-            writeToFile(vector.begin(), vector.end(), hashFunction, lengthEx, valueEx);
+            writeToFile(vector.begin(), vector.end(), hashFunction, lengthEx, valueEx, numThreads);
         }
 
-        void buildIndex() final {
+        void buildIndex(size_t numThreads = 1) final {
             constructionTimer.notifySyncedFile();
             StoreMetadata metadata = readMetadata(filename);
             if (metadata.type != StoreMetadata::TYPE_SEPARATOR + separatorBits) {
@@ -107,31 +131,32 @@ class SeparatorObjectStore : public VariableSizeObjectStore {
             numBlocks = metadata.numBlocks;
             maxSize = metadata.maxSize;
 
-            #ifdef HAS_LIBURING
-            UringDoubleBufferBlockIterator blockIterator(filename, numBlocks, 2500, openFlags);
-            #else
-            PosixBlockIterator blockIterator(filename, 2500, openFlags);
-            #endif
-            size_t objectsFound = 0;
             separators.resize(numBlocks);
             for (size_t i = 0; i < numBlocks; i++) {
                 separators.set(i, 0);
             }
-            for (size_t blocksRead = 0; blocksRead < numBlocks; blocksRead++) {
-                size_t blockIdx = blockIterator.blockNumber();
-                BlockStorage block(blockIterator.blockContent());
-                int maxSeparator = -1;
-                for (size_t i = 0; i < block.numObjects; i++) {
-                    if (block.keys[i] != 0) { // Key 0 holds metadata
-                        maxSeparator = std::max(maxSeparator, (int) separator(block.keys[i], blockIdx));
-                        objectsFound++;
+            numThreads = std::max(1ul, std::min(numThreads, numBlocks / 2500));
+            std::vector<size_t> objectsFoundInRange(numThreads, 0);
+            // Ranges are aligned to 64 blocks, so threads never write to the same word of the separator vector
+            forEachBlockRangeParallel(numBlocks, numThreads, 64, [&](size_t thread, size_t firstBlock, size_t endBlock) {
+                forEachBlock(filename, firstBlock, endBlock, openFlags, [&](size_t blockIdx, char *content) {
+                    BlockStorage block(content);
+                    int maxSeparator = -1;
+                    for (size_t i = 0; i < block.numObjects; i++) {
+                        if (block.keys[i] != 0) { // Key 0 holds metadata
+                            maxSeparator = std::max(maxSeparator, (int) separator(block.keys[i], blockIdx));
+                            objectsFoundInRange[thread]++;
+                        }
                     }
-                }
-                separators.set(blockIdx, maxSeparator + 1);
-                if (blocksRead < numBlocks - 1) {
-                    blockIterator.next();
-                }
-                LOG("Reading", blocksRead, numBlocks);
+                    separators.set(blockIdx, maxSeparator + 1);
+                    if (thread == 0) {
+                        LOG("Reading", blockIdx, endBlock);
+                    }
+                });
+            });
+            size_t objectsFound = 0;
+            for (size_t objects : objectsFoundInRange) {
+                objectsFound += objects;
             }
             LOG(nullptr);
             numObjects = objectsFound;
@@ -158,12 +183,6 @@ class SeparatorObjectStore : public VariableSizeObjectStore {
         }
 
     private:
-        void insert(StoreConfig::key_t key, size_t length, void *originalObject) {
-            Item item = {key, length, 0, 0, originalObject};
-            insertionQueue.push_back(item);
-            handleInsertionQueue();
-        }
-
         uint64_t separator(StoreConfig::key_t key, size_t bucket) {
             return bytehamster::util::fastrange64(
                 bytehamster::util::MurmurHash64Seeded(key, bucket), (1 << separatorBits) - 1);
@@ -174,14 +193,79 @@ class SeparatorObjectStore : public VariableSizeObjectStore {
                 bytehamster::util::MurmurHash64Seeded(key + 1, index), numBlocks);
         }
 
-        void handleInsertionQueue() {
-            while (!insertionQueue.empty()) {
-                Item item = insertionQueue.back();
-                insertionQueue.pop_back();
+        /**
+         * Each thread owns a range of blocks, aligned to 64 blocks so that threads never write to the same
+         * word of the separator vector. The threads first initialize their share of the items with initItem(i).
+         * In each round, a thread inserts the items whose probe sequence continues in its range,
+         * including the ones it bumps from its own blocks. The other items are passed on to the owner of their
+         * next block for the next round.
+         * Separators are only ever lowered, so the placement does not depend on the order of insertions.
+         * Sorting the items of each block by key then makes the blocks independent of the number of threads.
+         */
+        template <typename InitItem>
+        void placeItems(size_t numThreads, InitItem initItem) {
+            BlockRanges ranges(numBlocks, std::min(numThreads, (numBlocks + 63) / 64), 64);
+            numThreads = ranges.numThreads;
+            ThreadMailboxes<uint32_t> inbox(numThreads);
+            ThreadMailboxes<uint32_t> outbox(numThreads);
+            std::vector<std::vector<uint32_t>> queues(numThreads);
+            std::vector<std::vector<uint32_t>> sortBuffers(numThreads);
+            auto insertQueue = [&](size_t thread) {
+                handleInsertionQueue(queues[thread], sortBuffers[thread], ranges.firstBlock(thread),
+                                     ranges.endBlock(thread), [&](size_t block, uint32_t item) {
+                    outbox.send(thread, ranges.rangeOf(block), item);
+                });
+            };
+
+            size_t numItems = blocks.items.size();
+            ranges.inParallel([&](size_t thread) {
+                for (size_t i = numItems * thread / numThreads; i < numItems * (thread + 1) / numThreads; i++) {
+                    initItem(i);
+                    queues[thread].push_back(i);
+                }
+                insertQueue(thread);
+            });
+            while (!outbox.empty()) {
+                std::swap(inbox, outbox);
+                ranges.inParallel([&](size_t thread) {
+                    inbox.receive(thread, queues[thread]);
+                    insertQueue(thread);
+                });
+            }
+
+            ranges.inParallel([&](size_t thread) {
+                std::vector<uint32_t> &sortedItems = sortBuffers[thread];
+                for (size_t block = ranges.firstBlock(thread); block < ranges.endBlock(thread); block++) {
+                    sortedItems.clear();
+                    for (uint32_t i = blocks.at(block).firstItem; i != BlockObjectWriter::NO_ITEM; i = blocks.items[i].next) {
+                        sortedItems.push_back(i);
+                    }
+                    std::sort(sortedItems.begin(), sortedItems.end(), [&](uint32_t lhs, uint32_t rhs) {
+                        return blocks.items[lhs].key < blocks.items[rhs].key;
+                    });
+                    blocks.assign(block, sortedItems.begin(), sortedItems.end());
+                }
+            });
+        }
+
+        /**
+         * Insert the items of the queue into the blocks [firstBlock, endBlock).
+         * Items that are bumped from these blocks are added to the queue again.
+         * Items whose probe sequence continues outside of the range are passed to passOn(block, item).
+         */
+        template <typename PassOn>
+        void handleInsertionQueue(std::vector<uint32_t> &queue, std::vector<uint32_t> &sortBuffer,
+                                  size_t firstBlock, size_t endBlock, PassOn passOn) {
+            while (!queue.empty()) {
+                throwIfConstructionCancelled();
+                uint32_t itemIndex = queue.back();
+                queue.pop_back();
+                Item &item = blocks.items[itemIndex];
 
                 size_t block = chainBlock(item.key, item.hashFunctionIndex);
-                size_t separatorCache;
-                while ((separatorCache = separator(item.key, block)) >= separators.at(block)) {
+                size_t separatorCache = 0;
+                while (block >= firstBlock && block < endBlock
+                        && (separatorCache = separator(item.key, block)) >= separators.at(block)) {
                     // We already bumped items from this block. We cannot insert new ones with larger separator
                     item.hashFunctionIndex++;
                     block = chainBlock(item.key, item.hashFunctionIndex);
@@ -193,9 +277,13 @@ class SeparatorObjectStore : public VariableSizeObjectStore {
                                 "Try reducing the load factor or increasing the separator length.");
                     }
                 }
+                if (block < firstBlock || block >= endBlock) {
+                    passOn(block, itemIndex);
+                    continue;
+                }
 
                 item.currentHash = separatorCache;
-                blocks.at(block).items.push_back(item);
+                blocks.append(block, itemIndex);
                 blocks.at(block).length += item.length + overheadPerObject;
 
                 size_t maxSize = StoreConfig::BLOCK_LENGTH - overheadPerBlock;
@@ -203,12 +291,12 @@ class SeparatorObjectStore : public VariableSizeObjectStore {
                     maxSize -= sizeof(StoreMetadata) + overheadPerObject;
                 }
                 if (blocks.at(block).length > maxSize) {
-                    handleOverflowingBucket(block);
+                    handleOverflowingBucket(block, queue, sortBuffer);
                 }
             }
         }
 
-        void handleOverflowingBucket(size_t block) {
+        void handleOverflowingBucket(size_t block, std::vector<uint32_t> &queue, std::vector<uint32_t> &sortedItems) {
             size_t maxSize = StoreConfig::BLOCK_LENGTH - overheadPerBlock;
             if (block == 0) {
                 maxSize -= sizeof(StoreMetadata) + overheadPerObject;
@@ -217,43 +305,39 @@ class SeparatorObjectStore : public VariableSizeObjectStore {
                 return;
             }
 
-            std::sort(blocks.at(block).items.begin(), blocks.at(block).items.end(),
-                      [&]( const auto& lhs, const auto& rhs ) {
-                          return lhs.currentHash < rhs.currentHash;
+            sortedItems.clear();
+            for (uint32_t i = blocks.at(block).firstItem; i != BlockObjectWriter::NO_ITEM; i = blocks.items[i].next) {
+                sortedItems.push_back(i);
+            }
+            std::sort(sortedItems.begin(), sortedItems.end(), [&](uint32_t lhs, uint32_t rhs) {
+                return blocks.items[lhs].currentHash < blocks.items[rhs].currentHash;
             });
 
-            blocks.at(block).length = 0;
+            size_t length = 0;
             size_t tooLargeItemSeparator = ~0ul;
-            auto it = blocks.at(block).items.begin();
-            while (it != blocks.at(block).items.end()) {
-                blocks.at(block).length += (*it).length + overheadPerObject;
-                if (blocks.at(block).length > maxSize) {
-                    tooLargeItemSeparator = it->currentHash;
+            size_t itemsToKeep = 0;
+            for (; itemsToKeep < sortedItems.size(); itemsToKeep++) {
+                const Item &item = blocks.items[sortedItems[itemsToKeep]];
+                if (length + item.length + overheadPerObject > maxSize) {
+                    tooLargeItemSeparator = item.currentHash;
                     break;
                 }
-                ++it;
+                length += item.length + overheadPerObject;
             }
             assert(tooLargeItemSeparator != ~0ul);
-            bool removeFromBeginning = false;
-            while (it->currentHash>= tooLargeItemSeparator) {
-                blocks.at(block).length -= (*it).length + overheadPerObject;
-                if (it == blocks.at(block).items.begin()) {
-                    removeFromBeginning = true;
-                    break;
-                }
-                --it;
-            }
-            if (!removeFromBeginning) {
-                ++it; // Iterator now points to first item that should be removed
+            // All items with the separator of the first item that does not fit have to be removed
+            while (itemsToKeep > 0 && blocks.items[sortedItems[itemsToKeep - 1]].currentHash >= tooLargeItemSeparator) {
+                itemsToKeep--;
+                length -= blocks.items[sortedItems[itemsToKeep]].length + overheadPerObject;
             }
 
-            while (it != blocks.at(block).items.end()) {
-                Item overflowedItem = *it;
-                overflowedItem.hashFunctionIndex++;
-                insertionQueue.push_back(overflowedItem);
-                it = blocks.at(block).items.erase(it);
+            for (size_t i = itemsToKeep; i < sortedItems.size(); i++) {
+                blocks.items[sortedItems[i]].hashFunctionIndex++;
+                queue.push_back(sortedItems[i]);
             }
-            assert(tooLargeItemSeparator != 0 || blocks.at(block).items.size() == 0);
+            blocks.assign(block, sortedItems.begin(), sortedItems.begin() + itemsToKeep);
+            blocks.at(block).length = length;
+            assert(tooLargeItemSeparator != 0 || blocks.at(block).numItems == 0);
             assert(separators.at(block) == 0 || tooLargeItemSeparator <= separators.at(block));
             separators.set(block, tooLargeItemSeparator);
         }
@@ -283,7 +367,8 @@ class SeparatorObjectStore : public VariableSizeObjectStore {
             handle->stats.notifyStartQuery();
             size_t block = findBlockToAccess(handle->key);
             handle->stats.notifyFoundBlock(1);
-            ioManager->enqueueRead(handle->buffer, block * StoreConfig::BLOCK_LENGTH, StoreConfig::BLOCK_LENGTH,
+            handle->acquireBuffer(StoreConfig::BLOCK_LENGTH);
+            ioManager->enqueueRead(handle->readBuffer(), block * StoreConfig::BLOCK_LENGTH, StoreConfig::BLOCK_LENGTH,
                                    reinterpret_cast<uint64_t>(handle));
         }
 
@@ -305,9 +390,10 @@ class SeparatorObjectStore : public VariableSizeObjectStore {
 
         void parse(QueryHandle *handle) {
             handle->stats.notifyFetchedBlock();
-            std::tuple<size_t, char *> result = findKeyWithinNonOverlappingBlock(handle->key, handle->buffer);
+            std::tuple<size_t, char *> result = findKeyWithinNonOverlappingBlock(handle->key, handle->readBuffer());
             handle->length = std::get<0>(result);
             handle->resultPtr = std::get<1>(result);
+            handle->setContiguousFragment();
             handle->stats.notifyFoundKey();
             handle->state = 0;
         }
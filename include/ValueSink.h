@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cassert>
+#include <cstring>
+#include <type_traits>
+
+namespace pachash {
+/**
+ * Receives the content of an object in pieces.
+ * Instead of a value pointer extractor that returns a pointer to the complete value, the object stores accept
+ * a value producer that is called as producer(object, sink) and appends the value to the sink.
+ * The appended pieces must add up to exactly the length that the length extractor returns.
+ * This avoids a copy for values that need to be transformed (decompressed, reformatted) while writing.
+ */
+class ValueSink {
+    public:
+        virtual ~ValueSink() = default;
+        virtual void append(const char *data, size_t length) = 0;
+};
+
+/**
+ * Sink that writes to a contiguous memory area.
+ */
+class MemoryValueSink : public ValueSink {
+    private:
+        char *position;
+    public:
+        explicit MemoryValueSink(char *destination) : position(destination) {
+        }
+
+        void append(const char *data, size_t length) final {
+            memcpy(position, data, length);
+            position += length;
+        }
+
+        [[nodiscard]] char *end() const {
+            return position;
+        }
+};
+
+template <typename ValueExtractor, class U>
+constexpr bool isValueProducer = std::is_invocable_v<ValueExtractor, const U &, ValueSink &>;
+
+template <typename ValueExtractor, class U>
+constexpr bool isValueExtractor = std::is_invocable_r_v<const char *, ValueExtractor, U>
+        || isValueProducer<ValueExtractor, U>;
+
+/**
+ * Content of the object that can be passed to LinearObjectWriter::write.
+ * A pointer for value pointer extractors, a function that appends to a sink for value producers.
+ */
+template <typename ValueExtractor, class U>
+auto valueSource(ValueExtractor &valueExtractor, const U &object) {
+    if constexpr (isValueProducer<ValueExtractor, U>) {
+        return [&valueExtractor, &object](ValueSink &sink) {
+            valueExtractor(object, sink);
+        };
+    } else {
+        return static_cast<const char *>(valueExtractor(object));
+    }
+}
+
+/**
+ * Copy the content of the object to contiguous memory.
+ */
+template <typename ValueExtractor, class U>
+void copyValue(ValueExtractor &valueExtractor, const U &object, char *destination, size_t length) {
+    if constexpr (isValueProducer<ValueExtractor, U>) {
+        MemoryValueSink sink(destination);
+        valueExtractor(object, sink);
+        assert(sink.end() == destination + length && "Value producer did not append the declared length");
+    } else {
+        memcpy(destination, valueExtractor(object), length);
+    }
+}
+} // Namespace pachash
@@ -2,6 +2,7 @@
 
 #include <string>
 #include <iostream>
+#include <atomic>
 #include <chrono>
 #include <cassert>
 #include <functional>
@@ -13,14 +14,20 @@
 #include "QueryTimer.h"
 #include "ConstructionTimer.h"
 #include "IoManager.h"
+#include "WritePipeline.h"
+#include "ValueSink.h"
 #include "ObjectStoreView.h"
 #include "Log.h"
+#include "KeySearch.h"
 
 namespace pachash {
 class VariableSizeObjectStore {
     public:
         ConstructionTimer constructionTimer;
         const char* filename;
+        size_t writeQueueDepth = WritePipeline::DEFAULT_DEPTH; // Number of write buffers during construction
+        // When another thread sets this flag, stores that support it abort placing objects, see writeToFileDensest()
+        const std::atomic<bool> *cancelConstruction = nullptr;
         static constexpr size_t overheadPerObject = sizeof(StoreConfig::key_t) + sizeof(StoreConfig::offset_t);
         static constexpr size_t overheadPerBlock = sizeof(StoreConfig::num_objects_t) + sizeof(char); // num+emptyPageEnd
         struct StoreMetadata {
@@ -28,10 +35,16 @@ class VariableSizeObjectStore {
             static constexpr uint16_t TYPE_SEPARATOR = 2000;
             static constexpr uint16_t TYPE_CUCKOO = 0;
             char magic[32] = "Variable size object store file";
-            char version = 1;
+            char version = 2;
+            char padding1 = 0; // Explicit padding, so that the file contents are deterministic
             uint16_t type = 1;
+            uint32_t padding2 = 0;
             size_t numBlocks = 0;
             size_t maxSize = 0;
+            // Since version 2. Location of the persisted index, see IndexFooter
+            size_t indexOffset = 0;
+            size_t indexSize = 0;
+            size_t indexBinsPerBlock = 0;
         };
         class BlockStorage;
     protected:
@@ -41,6 +54,12 @@ class VariableSizeObjectStore {
         const float loadFactor;
         size_t totalPayloadSize = 0;
         int openFlags;
+
+        void throwIfConstructionCancelled() const {
+            if (cancelConstruction != nullptr && cancelConstruction->load(std::memory_order_relaxed)) {
+                throw std::invalid_argument("Construction cancelled");
+            }
+        }
     public:
 
         explicit VariableSizeObjectStore(float loadFactor, const char* filename, int openFlags)
@@ -51,8 +70,9 @@ class VariableSizeObjectStore {
 
         /**
          * Reload the data structure from the file and construct the internal-memory data structures.
+         * If the file needs to be scanned, numThreads threads read disjoint ranges of it.
          */
-        virtual void buildIndex() = 0;
+        virtual void buildIndex(size_t numThreads = 1) = 0;
 
         /**
          * Space usage per block, in bits.
@@ -77,6 +97,14 @@ class VariableSizeObjectStore {
         virtual size_t requiredBufferPerQuery() = 0;
         virtual size_t requiredIosPerQuery() = 0;
 
+        /**
+         * Buffer size that a query for the given key needs. At most requiredBufferPerQuery().
+         */
+        virtual size_t requiredBufferForKey(StoreConfig::key_t key) {
+            (void) key;
+            return requiredBufferPerQuery();
+        }
+
         /**
          * Table layout for methods that do not have overlapping objects is shifted:
          * Object 0 always starts at position 0. Object i starts at offset[i-1].
@@ -85,20 +113,18 @@ class VariableSizeObjectStore {
          */
         static std::tuple<size_t, char *> findKeyWithinNonOverlappingBlock(StoreConfig::key_t key, char *data) {
             BlockStorage block(data);
-            for (size_t i = 0; i < block.numObjects; i++) {
-                if (key == block.keys[i]) {
-                    if (i == 0) {
-                        return std::make_tuple(
-                                block.offsets[0], // Size
-                                block.blockStart); // Pointer
-                    } else {
-                        return std::make_tuple(
-                                block.offsets[i] - block.offsets[i - 1], // Size
-                                block.blockStart + block.offsets[i - 1]); // Pointer
-                    }
-                }
+            size_t i = findKeyInTable(block.keys, block.numObjects, key);
+            if (i == block.numObjects) {
+                return std::make_tuple(0, nullptr);
+            } else if (i == 0) {
+                return std::make_tuple(
+                        block.offsets[0], // Size
+                        block.blockStart); // Pointer
+            } else {
+                return std::make_tuple(
+                        block.offsets[i] - block.offsets[i - 1], // Size
+                        block.blockStart + block.offsets[i - 1]); // Pointer
             }
-            return std::make_tuple(0, nullptr);
         }
 
         template <class Iterator, typename LengthExtractor, class U = typename std::iterator_traits<Iterator>::value_type>
@@ -191,6 +217,11 @@ class VariableSizeObjectStore {
             struct StoreMetadata defaultMetadata;
             if (memcmp(&defaultMetadata.magic, &metadata.magic, sizeof(metadata.magic)) != 0) {
                 throw std::logic_error("Magic bytes do not match. Is this really an object store?");
+            } else if (metadata.version == 1) {
+                // Version 1 has the same layout but ends before the index location
+                metadata.indexOffset = 0;
+                metadata.indexSize = 0;
+                metadata.indexBinsPerBlock = 0;
             } else if (defaultMetadata.version != metadata.version) {
                 throw std::logic_error("Loaded file is version " + std::to_string(metadata.version)
                     + " but this binary supports only version " + std::to_string(defaultMetadata.version));
@@ -204,7 +235,7 @@ class VariableSizeObjectStore {
             public:
                 char *blockStart = nullptr;
                 StoreConfig::num_objects_t numObjects = 0;
-                char emptyPageEnd = 0;
+                uint8_t emptyPageEnd = 0; // Up to 255 bytes, which does not fit into a signed char
                 char *tableStart = nullptr;
                 StoreConfig::offset_t *offsets = nullptr;
                 StoreConfig::key_t *keys = nullptr;
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <chrono>
+#include <vector>
+#include <fcntl.h>
+#include "IoManager.h"
+
+namespace pachash {
+/**
+ * Writes consecutive batches of blocks with multiple writes in flight.
+ * The caller fills one buffer while the previous depth - 1 buffers are being written,
+ * so that packing objects and writing to the device overlap.
+ * Only waits for the device if all buffers are in flight. That time is reported as write stall.
+ * The file is preallocated in large steps ahead of the writes, so that the file system
+ * does not need to allocate space for every single write.
+ */
+class WritePipeline {
+    public:
+        static constexpr size_t DEFAULT_DEPTH = 4;
+        static constexpr size_t DEFAULT_BATCH_BLOCKS = 250;
+        static constexpr size_t PREALLOCATE_STEP = 64 * 1024 * 1024;
+        const size_t depth;
+        const size_t batchBlocks;
+    private:
+        std::vector<char *> buffers;
+        std::vector<bool> bufferInFlight;
+        size_t currentBuffer = 0;
+        size_t writesInFlight = 0;
+        size_t preallocatedEnd = 0;
+        bool preallocationSupported = true;
+        size_t stallNanoseconds = 0;
+        #ifdef HAS_LIBURING
+        UringIO ioManager;
+        #else
+        PosixIO ioManager;
+        #endif
+    public:
+        WritePipeline(const char *filename, int flags, size_t depth = DEFAULT_DEPTH,
+                      size_t batchBlocks = DEFAULT_BATCH_BLOCKS)
+                : depth(std::max(2ul, depth)), batchBlocks(batchBlocks),
+                  ioManager(filename, O_CREAT | flags, std::max(2ul, depth)) {
+            for (size_t i = 0; i < this->depth; i++) {
+                char *buffer = new (std::align_val_t(StoreConfig::BLOCK_LENGTH))
+                        char[batchBlocks * StoreConfig::BLOCK_LENGTH];
+                memset(buffer, 0, batchBlocks * StoreConfig::BLOCK_LENGTH);
+                buffers.push_back(buffer);
+            }
+            bufferInFlight.resize(this->depth, false);
+        }
+
+        ~WritePipeline() {
+            // The buffers must not be freed while the kernel still accesses them
+            while (writesInFlight > 0) {
+                bufferInFlight.at(ioManager.awaitAny() - 1) = false;
+                writesInFlight--;
+            }
+            for (char *buffer : buffers) {
+                operator delete[](buffer, std::align_val_t(StoreConfig::BLOCK_LENGTH));
+            }
+        }
+
+        static constexpr size_t memoryUsage(size_t depth = DEFAULT_DEPTH, size_t batchBlocks = DEFAULT_BATCH_BLOCKS) {
+            return depth * batchBlocks * StoreConfig::BLOCK_LENGTH;
+        }
+
+        /**
+         * Buffer of batchBlocks blocks that can be filled until the next call to write().
+         */
+        [[nodiscard]] char *buffer() const {
+            return buffers[currentBuffer];
+        }
+
+        /**
+         * Write the first numBlocks blocks of the current buffer to the given offset
+         * and continue with the next buffer.
+         */
+        void write(size_t offset, size_t numBlocks) {
+            assert(numBlocks > 0 && numBlocks <= batchBlocks);
+            size_t length = numBlocks * StoreConfig::BLOCK_LENGTH;
+            if (preallocationSupported && offset + length > preallocatedEnd) {
+                preallocate(offset, std::max(PREALLOCATE_STEP, length));
+            }
+            bufferInFlight[currentBuffer] = true;
+            ioManager.enqueueWrite(buffers[currentBuffer], offset, length, currentBuffer + 1);
+            ioManager.submit();
+            writesInFlight++;
+            currentBuffer = (currentBuffer + 1) % depth;
+            if (bufferInFlight[currentBuffer]) {
+                auto begin = std::chrono::steady_clock::now();
+                while (bufferInFlight[currentBuffer]) {
+                    bufferInFlight.at(ioManager.awaitAny() - 1) = false;
+                    writesInFlight--;
+                }
+                stallNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - begin).count();
+            }
+        }
+
+        void awaitAll() {
+            auto begin = std::chrono::steady_clock::now();
+            while (writesInFlight > 0) {
+                bufferInFlight.at(ioManager.awaitAny() - 1) = false;
+                writesInFlight--;
+            }
+            stallNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - begin).count();
+        }
+
+        /**
+         * Reserve space for the given range of the file without changing its size.
+         * Fails for partitions and some file systems, which we can safely ignore.
+         */
+        void preallocate(size_t offset, size_t length) {
+            if (fallocate(ioManager.fileDescriptor(), FALLOC_FL_KEEP_SIZE, offset, length) != 0) {
+                preallocationSupported = false;
+                return;
+            }
+            preallocatedEnd = std::max(preallocatedEnd, offset + length);
+        }
+
+        /**
+         * Time spent waiting for writes to complete, in nanoseconds.
+         */
+        [[nodiscard]] size_t writeStallNanoseconds() const {
+            return stallNanoseconds;
+        }
+};
+} // Namespace pachash